@@ -29,6 +29,11 @@ abstract sealed class DeviceSettings()
 
 final case class SerialDeviceSettings(val interface: String, val baudrate: Int) extends DeviceSettings
 
+object SerialDeviceSettings {
+  /** The bus speeds the module firmware can be built for (BUS_BAUDRATE). */
+  val Baudrates = Set(115200, 500000, 1000000, 1500000)
+}
+
 final case class NetworkDeviceSettings(val host: String, val port: Int) extends DeviceSettings
 
 final case class FileDeviceSettings(val path: String) extends DeviceSettings
@@ -57,13 +62,20 @@ class RichConfig(val config: Config) {
     val subconf = config.getConfig(baseKey)
     val deviceType = subconf.getString("type")
     deviceType match {
-      case "serial" => SerialDeviceSettings(subconf.getString("interface"), subconf.getInt("baudrate"))
+      case "serial" => SerialDeviceSettings(subconf.getString("interface"), getBaudrate(subconf))
       case "network" => NetworkDeviceSettings(subconf.getString("host"), subconf.getInt("port"))
       case "file" => FileDeviceSettings(subconf.getString("path"))
       case _ => throw new IllegalArgumentException("invalid value: " + subconf.origin())
     }
   }
 
+  def getBaudrate(subconf: Config): Int = {
+    val baudrate = subconf.getInt("baudrate")
+    if (!SerialDeviceSettings.Baudrates.contains(baudrate))
+      throw new IllegalArgumentException("unsupported baudrate " + baudrate + ": " + subconf.origin())
+    baudrate
+  }
+
   def getTokens(key: String): Map[TokenId, Token] = {
     getMap(key)(_.getBytes.toList.padTo(16, 0x00.toByte), (key, properties) => {
       val propertyMap = properties.asInstanceOf[java.util.Map[String, Object]].toMap
@@ -11,27 +11,37 @@ import com.typesafe.scalalogging.slf4j.Logging
  * Vaporlight LED modules require all of their LEDs to be updated at once.
  * This class caches the state of all LEDs so that even when only individual
  * LED states change, update messages can still be generated.
+ *
+ * Only the channels that changed since the last strobe are sent.
  */
 class Buffer(val settings: Settings, val encoder: Encoder) extends Logging {
   val moduleLedStates = mutable.Map[Byte, mutable.Seq[Int]]()
-  val dirtyModules = mutable.Set[Byte]()
+  val dirtyChannels = mutable.Map[Byte, mutable.Set[Int]]()
 
   def set(module: Byte, position: Int, value: Int) {
     if (!moduleLedStates.contains(module)) {
-      moduleLedStates(module) = Array.fill(settings.channelCounts(module)) {
+      val channelCount = settings.channelCounts(module)
+      moduleLedStates(module) = Array.fill(channelCount) {
         0
       }
+      // the module's state is unknown, so send everything once
+      dirtyChannels(module) = mutable.Set(0 until channelCount: _*)
+    }
+    if (moduleLedStates(module)(position) != value) {
+      moduleLedStates(module)(position) = value
+      dirtyChannels.getOrElseUpdate(module, mutable.Set[Int]()).add(position)
     }
-    moduleLedStates(module)(position) = value
-    dirtyModules.add(module)
-
   }
 
   def strobe() {
-    for ((module, values) <- moduleLedStates) {
-      encoder.update(module, values)
+    val (masked, complete) = dirtyChannels.partition {
+      case (module, channels) => encoder.prefersMasked(moduleLedStates(module), channels)
+    }
+    for ((module, channels) <- masked) {
+      encoder.updateMasked(module, moduleLedStates(module), channels)
     }
+    encoder.update(complete.keys.toSeq.map(module => (module, moduleLedStates(module): Seq[Int])))
     encoder.strobe()
-    dirtyModules.clear()
+    dirtyChannels.clear()
   }
 }
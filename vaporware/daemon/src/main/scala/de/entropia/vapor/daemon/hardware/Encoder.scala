@@ -1,5 +1,7 @@
 package de.entropia.vapor.hardware
 
+import de.entropia.vapor.util.UnsignedByte.Byte2UnsignedByte
+
 
 /**
  * Translates commands into byte sequences.
@@ -7,6 +9,8 @@ package de.entropia.vapor.hardware
 class Encoder(val framer: Framer) {
   val SET_RAW_COMMAND = 0x00.toByte
   val SET_XYY_COMMAND = 0x01.toByte
+  val SET_MASKED_COMMAND = 0x02.toByte
+  val SET_BULK_COMMAND = 0x03.toByte
   val STROBE_COMMAND = 0xFF.toByte
 
   val BROADCAST_ADDRESS = 0xFF.toByte
@@ -14,11 +18,61 @@ class Encoder(val framer: Framer) {
   val HIGH_MASK = 65280 // 0b1111111100000000
   val LOW_MASK = 255 // 0b0000000011111111
 
+  /** Number of channels a set-raw command carries. */
+  val MODULE_CHANNELS = 16
+
+  /** Maximum number of modules in one set-bulk command. */
+  val MAX_BULK_MODULES = 255
+
   def update(module: Byte, values: Seq[Int]) {
-    framer.write(Vector(module, SET_RAW_COMMAND) ++ values.flatMap(v =>
-      Vector(((v & HIGH_MASK) >> 8).toByte, (v & LOW_MASK).toByte)))
+    framer.write(Vector(module, SET_RAW_COMMAND) ++ values.flatMap(int16))
+  }
+
+  /**
+   * Sends complete updates for several modules.
+   *
+   * Modules with consecutive addresses are packed into set-bulk commands.
+   */
+  def update(modules: Seq[(Byte, Seq[Int])]) {
+    var run = Vector[(Byte, Seq[Int])]()
+    def writeRun() {
+      if (run.size == 1) {
+        update(run.head._1, run.head._2)
+      } else if (run.nonEmpty) {
+        framer.write(Vector(BROADCAST_ADDRESS, SET_BULK_COMMAND, run.head._1, run.size.toByte) ++
+          run.flatMap(_._2.flatMap(int16)))
+      }
+      run = Vector()
+    }
+
+    for ((module, values) <- modules.sortBy(_._1.toUnsignedInt)) {
+      if (values.size != MODULE_CHANNELS) {
+        update(module, values)
+      } else {
+        if (run.nonEmpty && (run.last._1.toUnsignedInt + 1 != module.toUnsignedInt || run.size == MAX_BULK_MODULES)) {
+          writeRun()
+        }
+        run :+= ((module, values))
+      }
+    }
+    writeRun()
   }
 
+  /** Whether sending only the given channels with set-masked is shorter than set-raw. */
+  def prefersMasked(values: Seq[Int], channels: collection.Set[Int]) =
+    // set-masked needs 2 bytes for the mask and 2 per channel, set-raw 2 per channel of the module
+    values.size == MODULE_CHANNELS && 2 + 2 * channels.size < 2 * values.size
+
+  /** Sends only the given channels of a module. */
+  def updateMasked(module: Byte, values: Seq[Int], channels: collection.Set[Int]) {
+    val sorted = channels.toSeq.sorted
+    val mask = sorted.foldLeft(0)((m, c) => m | (1 << c))
+    framer.write(Vector(module, SET_MASKED_COMMAND) ++ int16(mask) ++ sorted.flatMap(c => int16(values(c))))
+  }
+
+  private def int16(v: Int) =
+    Vector(((v & HIGH_MASK) >> 8).toByte, (v & LOW_MASK).toByte)
+
   def strobe() {
     framer.write(Vector(BROADCAST_ADDRESS, STROBE_COMMAND))
     framer.flush()
@@ -0,0 +1,25 @@
+#include "compositor.hpp"
+
+void compositor::set_leds(const std::vector<uint16_t>& LEDs, const vlpp::rgba_color& col){
+	std::lock_guard<std::mutex> lock(_mutex);
+	for(auto LED: LEDs){
+		_changed_LEDs[LED] = col;
+	}
+}
+
+void compositor::flush(vlpp::client& client){
+	// swap the frame out, so that the animations don't have
+	// to wait for the network:
+	std::map<uint16_t, vlpp::rgba_color> frame;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		frame.swap(_changed_LEDs);
+	}
+	if(frame.empty()){
+		return;
+	}
+	for(auto& LED: frame){
+		client.set_led(LED.first, LED.second);
+	}
+	client.flush();
+}
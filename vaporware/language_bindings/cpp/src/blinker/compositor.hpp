@@ -0,0 +1,46 @@
+#ifndef COMPOSITOR_HPP
+#define COMPOSITOR_HPP
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "../lib/client.hpp"
+#include "../lib/rgba_color.hpp"
+
+/**
+ * @brief Collects the LED-changes of all animations into one shared frame.
+ *
+ * Animations only write into the frame; the changes are sent to the server
+ * by flush(), which is meant to be called once per frame period by a single
+ * thread. This way the server receives at most one strobe per frame, no
+ * matter how many animations are running.
+ *
+ * All methods are threadsafe.
+ */
+class compositor {
+	public:
+		/**
+		 * @brief Sets some LEDs to a new color in the current frame.
+		 * @param LEDs a vector that contains the LED-IDs
+		 * @param col the new color
+		 */
+		void set_leds(const std::vector<uint16_t>& LEDs, const vlpp::rgba_color& col);
+
+		/**
+		 * @brief Sends all LEDs that changed since the last call and strobes once.
+		 *
+		 * Nothing is sent if no LED has changed.
+		 *
+		 * @param client the client that will be used to send the frame
+		 * @throws vlpp::connection_failure if the write fails
+		 */
+		void flush(vlpp::client& client);
+
+	private:
+		std::mutex _mutex;
+		std::map<uint16_t, vlpp::rgba_color> _changed_LEDs;
+};
+
+#endif
@@ -2,8 +2,9 @@
 
 #include <cstdint>
 #include <random>
+#include <algorithm>
 #include <chrono>
-#include <mutex>
+#include <thread>
 
 #include "settings.hpp"
 
@@ -38,29 +39,60 @@ void control_LEDs(std::vector<uint16_t> LEDs) {
 void fade_to(const std::vector<uint16_t>& LEDs,
 		useconds_t fade_time, const vlpp::rgba_color& old_color,
 		const vlpp::rgba_color& new_color){
-	useconds_t time_per_step = fade_time / settings::fade_steps;
-	for(int i=0; i < settings::fade_steps; ++i){
-		double p_new = double(i) / settings::fade_steps;
-		double p_old = 1 - p_new;
-		vlpp::rgba_color tmp{
-			// i really WANT this narrowing conversion:
-			uint8_t(old_color.r*p_old + new_color.r*p_new),
-			uint8_t(old_color.g*p_old + new_color.g*p_new),
-			uint8_t(old_color.b*p_old + new_color.b*p_new),
-			uint8_t(old_color.alpha*p_old + new_color.alpha*p_new)
-		};
-		set_leds(LEDs, tmp);
-		usleep(time_per_step);
+	using std::chrono::steady_clock;
+	const std::chrono::microseconds duration(fade_time);
+	const std::chrono::microseconds frame_period(1000000 / settings::frame_rate);
+	const auto start = steady_clock::now();
+	const auto end = start + duration;
+	int last_step = -1;
+	while(true){
+		auto elapsed = steady_clock::now() - start;
+		if(elapsed >= duration){
+			break;
+		}
+		// the colour only depends on the elapsed time, so if we are
+		// late, the steps in between are simply skipped:
+		// (elapsed counts in clock ticks, so compare it in the unit of
+		// the duration):
+		const double progress = std::chrono::duration<double>(elapsed) / duration;
+		int step = std::min(int(settings::fade_steps * progress), settings::fade_steps);
+		if(step != last_step){
+			double p_new = double(step) / settings::fade_steps;
+			double p_old = 1 - p_new;
+			vlpp::rgba_color tmp{
+				// i really WANT this narrowing conversion:
+				uint8_t(old_color.r*p_old + new_color.r*p_new),
+				uint8_t(old_color.g*p_old + new_color.g*p_new),
+				uint8_t(old_color.b*p_old + new_color.b*p_new),
+				uint8_t(old_color.alpha*p_old + new_color.alpha*p_new)
+			};
+			set_leds(LEDs, tmp);
+			last_step = step;
+		}
+		// wait for the next render tick, but never past the end of the fade:
+		auto next_frame = start + (elapsed / frame_period + 1) * frame_period;
+		std::this_thread::sleep_until(std::min(next_frame, end));
 	}
 	set_leds(LEDs, new_color);
 }
 
 
 void set_leds(std::vector<uint16_t> LEDs, const vlpp::rgba_color& col){
-	static std::mutex m;
-	std::lock_guard<std::mutex> lock(m);
-	for(auto LED: LEDs){
-		settings::client.set_led(LED, col);
+	settings::frame.set_leds(LEDs, col);
+}
+
+void render_frames(){
+	using std::chrono::steady_clock;
+	const std::chrono::microseconds frame_period(1000000 / settings::frame_rate);
+	auto next_frame = steady_clock::now();
+	while(!settings::thread_return_flag){
+		settings::frame.flush(settings::client);
+		next_frame += frame_period;
+		auto now = steady_clock::now();
+		if(next_frame < now){
+			// we are behind; don't try to catch up with a burst of frames:
+			next_frame = now;
+		}
+		std::this_thread::sleep_until(next_frame);
 	}
-	settings::client.flush();
 }
@@ -16,6 +16,11 @@ void control_LEDs(std::vector<uint16_t> LEDs);
 
 /**
  * @brief fades some LEDs to a new color.
+ * 
+ * The color is calculated from the elapsed time once per frame
+ * (see settings::frame_rate), so the fade ends on time even if
+ * some frames are missed.
+ * 
  * @param LEDs a vector that contains the LED-IDs
  * @param fade_time the time that will be used to fade to the new color.
  * @param old_color the old color
@@ -26,12 +31,21 @@ void fade_to(const std::vector<uint16_t>& LEDs,
 		const vlpp::rgba_color& new_color);
 
 /**
- * @brief Sets some LEDs to a new color in a synchronized way.
+ * @brief Sets some LEDs to a new color in the current frame.
+ * 
+ * The change will be sent to the server by render_frames().
+ * 
  * @param LEDs a vector that contains the LED-IDs
  * @param col the new color
  */
 void set_leds(std::vector<uint16_t> LEDs, const vlpp::rgba_color& col);
 
+/**
+ * @brief Sends the current frame to the server once per frame period until 
+ *        settings::thread_return_flag is set.
+ */
+void render_frames();
+
 
 
 
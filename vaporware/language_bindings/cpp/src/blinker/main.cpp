@@ -71,7 +71,9 @@ int main(int argc, char**argv){
 			("colors,c", value<std::string>(&colorset_str), "sets the used colorset")
 			("min-fade", value<useconds_t>(&settings::min_fade_time), "changes the minimum fade time")
 			("max-fade,f", value<useconds_t>(&settings::max_fade_time), "changes the maximum fade time")
-			("fade-steps,F", value<int>(&settings::fade_steps), "sets the number of steps for fading");
+			("fade-steps,F", value<int>(&settings::fade_steps), "sets the number of steps for fading")
+			("fps,r", value<unsigned>(&settings::frame_rate), 
+				"sets the maximum number of frames per second sent to the server");
 		
 		boost::program_options::variables_map vm;
 		boost::program_options::store (boost::program_options::parse_command_line(argc, argv, desc), vm);
@@ -83,11 +85,19 @@ int main(int argc, char**argv){
 		}
 		
 		vm.count("sync") && (async = false);
+		// the frame-period is counted in whole microseconds:
+		if(settings::frame_rate == 0 || settings::frame_rate > 1000000){
+			throw std::invalid_argument("the framerate must be between 1 and 1000000");
+		}
+		if(settings::fade_steps <= 0){
+			throw std::invalid_argument("the number of fade-steps must be positive");
+		}
 		settings::colorset = str_to_cols(colorset_str);
 		LEDs = str_to_ids(LED_string);
 		
 		settings::client = vlpp::client(server, token, port);
 		std::vector<std::thread> threads;
+		threads.emplace_back(render_frames);
 		if(async){
 			for(auto LED: LEDs){
 				threads.emplace_back(control_LEDs, std::vector<uint16_t>{LED});
@@ -1,10 +1,12 @@
 #include "settings.hpp"
 
 int settings::fade_steps = UINT8_MAX;
+unsigned settings::frame_rate = 50;
 useconds_t settings::min_sleep_time = 0;
 useconds_t settings::max_sleep_time = 100000;
 useconds_t settings::min_fade_time  = 0;
 useconds_t settings::max_fade_time  = 100000;
 std::vector<vlpp::rgba_color> settings::colorset = REAL_COLORS;
 vlpp::client settings::client;
+compositor settings::frame;
 std::atomic<bool> settings::thread_return_flag(false);
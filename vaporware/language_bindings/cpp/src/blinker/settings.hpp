@@ -8,14 +8,18 @@
 #include "../lib/client.hpp"
 #include "../util/colors.hpp"
 
+#include "compositor.hpp"
+
 struct settings{
 	static int fade_steps;
+	static unsigned frame_rate;
 	static useconds_t min_sleep_time;
 	static useconds_t max_sleep_time;
 	static useconds_t min_fade_time;
 	static useconds_t max_fade_time;
 	static std::vector<vlpp::rgba_color> colorset;
 	static vlpp::client client;
+	static compositor frame;
 	static std::atomic<bool> thread_return_flag;
 };
 
@@ -0,0 +1,197 @@
+/*
+ *  This file is part of vaporpp.
+ *
+ *  vaporpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vaporpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vaporpp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/crc.hpp>
+#include <boost/program_options.hpp>
+
+#include "../lib/bus_writer.hpp"
+
+// see the firmware update in HACKING:
+enum: uint8_t {
+	CMD_UPDATE = 0x07,
+	CMD_UPDATE_CHUNK = 0x08,
+	CMD_UPDATE_END = 0x09
+};
+
+enum: std::size_t {
+	CHUNK_SIZE = 64,
+	// everything between the loader and the config-page:
+	FIRMWARE_AREA_SIZE = 13 * 1024,
+	// but the last chunk, which holds the image-info:
+	MAX_IMAGE_SIZE = FIRMWARE_AREA_SIZE - CHUNK_SIZE,
+	PAGE_SIZE = 1024
+};
+
+namespace {
+
+void push_int16(std::vector<uint8_t>& buffer, uint16_t value) {
+	buffer.push_back((uint8_t)(value >> 8));
+	buffer.push_back((uint8_t)(value & 0xff));
+}
+
+void push_int32(std::vector<uint8_t>& buffer, uint32_t value) {
+	push_int16(buffer, (uint16_t)(value >> 16));
+	push_int16(buffer, (uint16_t)(value & 0xffff));
+}
+
+uint32_t crc32(const uint8_t* data, std::size_t length) {
+	boost::crc_32_type crc;
+	crc.process_bytes(data, length);
+	return crc.checksum();
+}
+
+/*
+ * Reads the image and pads it with erased flash to whole chunks.
+ */
+std::vector<uint8_t> read_image(const std::string& filename) {
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) {
+		throw std::runtime_error("cannot open " + filename);
+	}
+	std::vector<uint8_t> image{std::istreambuf_iterator<char>(file),
+		std::istreambuf_iterator<char>()};
+	if (image.empty() || image.size() > MAX_IMAGE_SIZE) {
+		throw std::runtime_error(filename + " is empty or larger than the firmware-area");
+	}
+	image.resize((image.size() + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE, 0xff);
+	return image;
+}
+
+void sleep_ms(unsigned ms) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+} // anonymous namespace
+
+
+/*
+ * this program will replace the firmware of all modules on the bus
+ */
+int main(int argc, char** argv) {
+	using std::string;
+	namespace bpo = boost::program_options;
+
+	string device;
+	string image_file;
+	unsigned baudrate;
+	unsigned address;
+	unsigned passes;
+	unsigned chunk_delay;
+	unsigned erase_delay;
+	bool verbose = false;
+
+	try{
+		bpo::options_description desc;
+		desc.add_options()
+				("help,h", "print this help")
+				("verbose,v", "print the progress")
+				("device,d", bpo::value<string>(&device)->required(),
+				 "sets the serial device of the bus")
+				("baudrate,b", bpo::value<unsigned>(&baudrate)->default_value(
+					vlpp::bus_writer::DEFAULT_BAUDRATE), "sets the baudrate of the bus")
+				("image,i", bpo::value<string>(&image_file)->required(),
+				 "sets the firmware-image (led-board.bin)")
+				("address,a", bpo::value<unsigned>(&address)->default_value(
+					vlpp::bus_writer::BROADCAST),
+				 "updates only the modules with this address or group "
+				 "(and those without a valid firmware)")
+				("passes,p", bpo::value<unsigned>(&passes)->default_value(3),
+				 "sets how often the image is sent")
+				("chunk-delay,c", bpo::value<unsigned>(&chunk_delay)->default_value(3),
+				 "sets the pause after each chunk in ms, in which the modules write it")
+				("erase-delay,e", bpo::value<unsigned>(&erase_delay)->default_value(
+					FIRMWARE_AREA_SIZE / PAGE_SIZE * 40 + 100),
+				 "sets the pause in ms, in which the modules erase their firmware");
+
+		bpo::variables_map vm;
+		bpo::store(bpo::parse_command_line(argc, argv, desc) ,vm);
+		if (vm.count("help")) {
+			std::cout << desc << std::endl;
+			return 0;
+		}
+		bpo::notify(vm);
+		verbose = vm.count("verbose");
+
+		if (address > vlpp::bus_writer::BROADCAST || passes == 0) {
+			std::cerr << "Error: invalid address or number of passes." << std::endl;
+			return 1;
+		}
+
+		const std::vector<uint8_t> image = read_image(image_file);
+		const uint16_t chunks = (uint16_t)(image.size() / CHUNK_SIZE);
+		const uint32_t image_crc = crc32(image.data(), image.size());
+
+		vlpp::bus_writer bus(device, baudrate);
+
+		std::vector<uint8_t> update{(uint8_t)address, CMD_UPDATE, 'V', 'L'};
+		push_int16(update, chunks);
+		push_int32(update, image_crc);
+
+		// the modules cannot answer on the bus, so every module gets
+		// several chances to receive each chunk. A module resets into
+		// its loader and erases its firmware when it gets the
+		// update-command; the command is repeated for every pass, so
+		// that a module that lost power meanwhile starts over, while
+		// the others ignore it. A module resets into the new firmware
+		// at the first end-frame after it has got every chunk, or
+		// erases again if the image is broken:
+		for (unsigned pass = 1; pass <= passes; ++pass) {
+			bus.send_frame(update);
+			bus.send_frames();
+			sleep_ms(erase_delay);
+
+			std::vector<uint8_t> payload;
+			for (uint16_t chunk = 0; chunk < chunks; ++chunk) {
+				payload = {(uint8_t)address, CMD_UPDATE_CHUNK};
+				push_int16(payload, chunk);
+				payload.insert(payload.end(), image.begin() + chunk * CHUNK_SIZE,
+						image.begin() + (chunk + 1) * CHUNK_SIZE);
+				// the CRC covers the chunk-index and the data:
+				push_int32(payload, crc32(payload.data() + 2, payload.size() - 2));
+				bus.send_frame(payload);
+				bus.send_frames();
+				sleep_ms(chunk_delay);
+			}
+			bus.send_frame({(uint8_t)address, CMD_UPDATE_END});
+			bus.send_frames();
+			sleep_ms(erase_delay);
+			if (verbose) {
+				std::cout << "pass " << pass << " of " << passes << " done" << std::endl;
+			}
+		}
+		if (verbose) {
+			std::cout << "sent " << chunks << " chunks with CRC " << std::hex
+				<< image_crc << std::dec << std::endl;
+		}
+	}
+	catch(std::exception& e){
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+}
@@ -0,0 +1,409 @@
+/*
+ *  This file is part of vaporpp.
+ *
+ *  vaporpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vaporpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vaporpp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bus_writer.hpp"
+
+#include <array>
+#include <algorithm>
+#include <bitset>
+#include <map>
+#include <stdexcept>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+// framing:
+enum: uint8_t {
+	ESCAPE_MARK = 0x54,
+	START_MARK = 0x55
+};
+
+// bus-commands:
+enum: uint8_t {
+	CMD_SET_RAW = 0x00,
+	CMD_SET_XYY = 0x01,
+	CMD_SET_MASKED = 0x02,
+	CMD_SET_BULK = 0x03,
+	CMD_STROBE = 0xFF
+};
+
+
+//pimpl-class (private members of bus_writer):
+class vlpp::bus_writer::bus_writer_impl {
+	public:
+		bus_writer_impl(const std::string& device, unsigned baudrate, bool create);
+		~bus_writer_impl();
+		void map_led(uint16_t led, const std::array<channel_address, 3>& channels);
+		void set_led(uint16_t led, const rgba_color& col);
+		void set_channel(channel_address address, uint16_t value);
+		void write_channel(channel_address address, uint16_t value);
+		void set_xyY(uint8_t module, uint8_t led, uint16_t x, uint16_t y, uint16_t Y);
+		void add_frame(const uint8_t* payload, std::size_t length);
+		void add_complete_modules(std::vector<uint8_t>& addresses);
+		void flush();
+		void send_frames();
+		void write_out();
+		
+		struct module_state {
+			std::array<uint16_t, MODULE_CHANNELS> raw{};
+			std::array<uint16_t, 3 * MODULE_RGB_LEDS> xyY{};
+			bool use_xyY = false;
+			bool xyY_changed = false;
+			// one bit per raw channel that changed since the last flush;
+			// the state of a new module is unknown, so it is sent completely:
+			uint16_t changed_channels = 0xffff;
+		};
+		
+		int _fd;
+		std::map<uint16_t, std::array<channel_address, 3>> _mapping;
+		// ordered, so that the modules are always sent in the same order:
+		std::map<uint8_t, module_state> _modules;
+		std::vector<uint8_t> _out_buffer;
+};
+
+namespace {
+
+speed_t to_speed(unsigned baudrate) {
+	switch (baudrate) {
+		case 115200:
+			return B115200;
+		case 500000:
+			return B500000;
+		case 1000000:
+			return B1000000;
+		case 1500000:
+			return B1500000;
+		default:
+			throw std::invalid_argument("unsupported baudrate");
+	}
+}
+
+void check_address(vlpp::channel_address address) {
+	if (address.module == vlpp::bus_writer::BROADCAST
+			|| address.channel >= vlpp::bus_writer::MODULE_CHANNELS) {
+		throw std::invalid_argument("invalid channel-address");
+	}
+}
+
+void push_int16(std::vector<uint8_t>& buffer, uint16_t value) {
+	buffer.push_back((uint8_t)(value >> 8));
+	buffer.push_back((uint8_t)(value & 0xff));
+}
+
+} // anonymous namespace
+
+///////////
+
+
+vlpp::bus_writer::bus_writer(const std::string& device, unsigned baudrate, bool create):
+	_impl(new vlpp::bus_writer::bus_writer_impl(device, baudrate, create)) {
+}
+
+vlpp::bus_writer::bus_writer(bus_writer&& other){
+	_impl = other._impl;
+	other._impl = nullptr;
+}
+
+vlpp::bus_writer& vlpp::bus_writer::operator=(bus_writer&& other){
+	std::swap(_impl, other._impl);
+	return *this;
+}
+
+vlpp::bus_writer::~bus_writer() {
+	if( _impl ){
+		delete _impl;
+	}
+}
+
+void vlpp::bus_writer::map_led(uint16_t led_id, channel_address r, channel_address g, channel_address b) {
+	if(!_impl){
+		throw vlpp::uninitialized_error("uninitialized use of a vlpp::bus_writer");
+	}
+	_impl->map_led(led_id, {{r, g, b}});
+}
+
+void vlpp::bus_writer::set_led(uint16_t led_id, const rgba_color& col) {
+	if(!_impl){
+		throw vlpp::uninitialized_error("uninitialized use of a vlpp::bus_writer");
+	}
+	_impl->set_led(led_id, col);
+}
+
+void vlpp::bus_writer::set_leds(const std::vector<uint16_t>& led_ids, const rgba_color& col) {
+	if(!_impl){
+		throw vlpp::uninitialized_error("uninitialized use of a vlpp::bus_writer");
+	}
+	for (auto led: led_ids) {
+		_impl->set_led(led, col);
+	}
+}
+
+void vlpp::bus_writer::set_channel(channel_address address, uint16_t value) {
+	if(!_impl){
+		throw vlpp::uninitialized_error("uninitialized use of a vlpp::bus_writer");
+	}
+	_impl->set_channel(address, value);
+}
+
+void vlpp::bus_writer::set_xyY(uint8_t module, uint8_t led, uint16_t x, uint16_t y, uint16_t Y) {
+	if(!_impl){
+		throw vlpp::uninitialized_error("uninitialized use of a vlpp::bus_writer");
+	}
+	_impl->set_xyY(module, led, x, y, Y);
+}
+
+void vlpp::bus_writer::send_frame(const std::vector<uint8_t>& payload) {
+	if(!_impl){
+		throw vlpp::uninitialized_error("uninitialized use of a vlpp::bus_writer");
+	}
+	if (payload.empty()) {
+		throw std::invalid_argument("empty frame");
+	}
+	_impl->add_frame(payload.data(), payload.size());
+}
+
+void vlpp::bus_writer::flush() {
+	if(!_impl){
+		throw vlpp::uninitialized_error("uninitialized use of a vlpp::bus_writer");
+	}
+	_impl->flush();
+}
+
+void vlpp::bus_writer::send_frames() {
+	if(!_impl){
+		throw vlpp::uninitialized_error("uninitialized use of a vlpp::bus_writer");
+	}
+	_impl->send_frames();
+}
+
+///////// now: the private stuff
+
+
+vlpp::bus_writer::bus_writer_impl::bus_writer_impl(const std::string& device, unsigned baudrate,
+		bool create) {
+	// check this first, so that we don't have to close the device again:
+	speed_t speed = to_speed(baudrate);
+	
+	// only create a file on request, so that a mistyped device fails:
+	int flags = O_WRONLY | O_NOCTTY;
+	if (create) {
+		flags |= O_CREAT | O_TRUNC;
+	}
+	_fd = open(device.c_str(), flags, 0644);
+	if (_fd < 0) {
+		throw vlpp::connection_failure("cannot open " + device);
+	}
+	if (!isatty(_fd)) {
+		// a plain file or pipe:
+		return;
+	}
+	termios tty;
+	if (tcgetattr(_fd, &tty) != 0) {
+		close(_fd);
+		throw vlpp::connection_failure("cannot read the settings of " + device);
+	}
+	cfmakeraw(&tty);
+	// 8N1 without flow-control:
+	tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tty.c_cflag |= CLOCAL;
+	cfsetospeed(&tty, speed);
+	cfsetispeed(&tty, speed);
+	if (tcsetattr(_fd, TCSANOW, &tty) != 0) {
+		close(_fd);
+		throw vlpp::connection_failure("cannot configure " + device);
+	}
+}
+
+vlpp::bus_writer::bus_writer_impl::~bus_writer_impl() {
+	close(_fd);
+}
+
+void vlpp::bus_writer::bus_writer_impl::map_led(uint16_t led,
+		const std::array<channel_address, 3>& channels) {
+	for (auto address: channels) {
+		check_address(address);
+	}
+	_mapping[led] = channels;
+}
+
+void vlpp::bus_writer::bus_writer_impl::set_led(uint16_t led, const rgba_color& col) {
+	auto it = _mapping.find(led);
+	if (it == _mapping.end()) {
+		return;
+	}
+	const std::array<uint8_t, 3> values{{col.r, col.g, col.b}};
+	for (std::size_t i = 0; i < 3; ++i) {
+		const channel_address address = it->second[i];
+		uint32_t current = _modules[address.module].raw[address.channel];
+		// expand to 16 bit, so that 0xff becomes 0xffff:
+		uint32_t value = values[i] * 0x0101u;
+		uint32_t alpha = col.alpha * 0x0101u;
+		write_channel(address, (uint16_t)((value * alpha + current * (0xffffu - alpha)) / 0xffffu));
+	}
+}
+
+void vlpp::bus_writer::bus_writer_impl::set_channel(channel_address address, uint16_t value) {
+	check_address(address);
+	write_channel(address, value);
+}
+
+void vlpp::bus_writer::bus_writer_impl::write_channel(channel_address address, uint16_t value) {
+	module_state& module = _modules[address.module];
+	if (module.use_xyY) {
+		// the module forgot its raw values:
+		module.use_xyY = false;
+		module.changed_channels = 0xffff;
+	}
+	if (module.raw[address.channel] != value) {
+		module.raw[address.channel] = value;
+		module.changed_channels |= (uint16_t)(1u << address.channel);
+	}
+}
+
+void vlpp::bus_writer::bus_writer_impl::set_xyY(uint8_t module_address, uint8_t led,
+		uint16_t x, uint16_t y, uint16_t Y) {
+	if (module_address == BROADCAST || led >= MODULE_RGB_LEDS) {
+		throw std::invalid_argument("invalid module or LED");
+	}
+	module_state& module = _modules[module_address];
+	module.xyY[3 * led + 0] = x;
+	module.xyY[3 * led + 1] = y;
+	module.xyY[3 * led + 2] = Y;
+	module.use_xyY = true;
+	module.xyY_changed = true;
+}
+
+void vlpp::bus_writer::bus_writer_impl::add_frame(const uint8_t* payload, std::size_t length) {
+	_out_buffer.push_back(START_MARK);
+	for (std::size_t i = 0; i < length; ++i) {
+		switch (payload[i]) {
+			case ESCAPE_MARK:
+				_out_buffer.push_back(ESCAPE_MARK);
+				_out_buffer.push_back(0x00);
+				break;
+			case START_MARK:
+				_out_buffer.push_back(ESCAPE_MARK);
+				_out_buffer.push_back(0x01);
+				break;
+			default:
+				_out_buffer.push_back(payload[i]);
+		}
+	}
+}
+
+void vlpp::bus_writer::bus_writer_impl::add_complete_modules(std::vector<uint8_t>& addresses) {
+	if (addresses.empty()) {
+		return;
+	}
+	std::vector<uint8_t> payload;
+	if (addresses.size() == 1) {
+		payload = {addresses.front(), CMD_SET_RAW};
+	}
+	else {
+		payload = {BROADCAST, CMD_SET_BULK, addresses.front(), (uint8_t)addresses.size()};
+	}
+	for (auto address: addresses) {
+		for (auto value: _modules[address].raw) {
+			push_int16(payload, value);
+		}
+	}
+	add_frame(payload.data(), payload.size());
+	addresses.clear();
+}
+
+void vlpp::bus_writer::bus_writer_impl::flush() {
+	std::vector<uint8_t> payload;
+	// modules with consecutive addresses that are sent completely
+	// are packed into one set-bulk frame:
+	std::vector<uint8_t> complete_modules;
+	for (auto& entry: _modules) {
+		module_state& module = entry.second;
+		payload.clear();
+		payload.push_back(entry.first);
+		if (module.use_xyY) {
+			if (!module.xyY_changed) {
+				continue;
+			}
+			payload.push_back(CMD_SET_XYY);
+			for (auto value: module.xyY) {
+				push_int16(payload, value);
+			}
+			module.xyY_changed = false;
+		}
+		else {
+			const uint16_t mask = module.changed_channels;
+			if (mask == 0) {
+				continue;
+			}
+			// set-masked needs two bytes for the mask and two per channel:
+			if (2 + 2 * std::bitset<MODULE_CHANNELS>(mask).count() < 2 * MODULE_CHANNELS) {
+				payload.push_back(CMD_SET_MASKED);
+				push_int16(payload, mask);
+				for (std::size_t c = 0; c < MODULE_CHANNELS; ++c) {
+					if (mask & (1u << c)) {
+						push_int16(payload, module.raw[c]);
+					}
+				}
+			}
+			else {
+				module.changed_channels = 0;
+				if (!complete_modules.empty() && complete_modules.back() + 1 != entry.first) {
+					add_complete_modules(complete_modules);
+				}
+				complete_modules.push_back(entry.first);
+				continue;
+			}
+			module.changed_channels = 0;
+		}
+		add_frame(payload.data(), payload.size());
+	}
+	add_complete_modules(complete_modules);
+	
+	const uint8_t strobe[] = {BROADCAST, CMD_STROBE};
+	add_frame(strobe, sizeof(strobe));
+	
+	write_out();
+}
+
+void vlpp::bus_writer::bus_writer_impl::send_frames() {
+	write_out();
+	if (isatty(_fd) && tcdrain(_fd) != 0) {
+		throw vlpp::connection_failure("write failed");
+	}
+}
+
+void vlpp::bus_writer::bus_writer_impl::write_out() {
+	// everything goes out in one write, so that the frames follow
+	// each other without gaps on the bus:
+	std::size_t written = 0;
+	while (written < _out_buffer.size()) {
+		ssize_t n = write(_fd, _out_buffer.data() + written, _out_buffer.size() - written);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			_out_buffer.clear();
+			throw vlpp::connection_failure("write failed");
+		}
+		written += n;
+	}
+	_out_buffer.clear();
+}
@@ -0,0 +1,230 @@
+/*
+ *  This file is part of vaporpp.
+ *
+ *  vaporpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vaporpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vaporpp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUS_WRITER_HPP
+#define BUS_WRITER_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include "client.hpp"
+#include "rgba_color.hpp"
+
+namespace vlpp {
+
+/**
+ * @brief The address of a single PWM-channel on the bus.
+ */
+struct channel_address {
+	/**
+	 * @brief the address of the LED-module
+	 */
+	uint8_t module;
+	
+	/**
+	 * @brief the channel on that module (0 to bus_writer::MODULE_CHANNELS-1)
+	 */
+	uint8_t channel;
+};
+
+/**
+ * @brief Talks directly to the LED-modules on the bus, without a server in between.
+ *
+ * This implements the bus protocol from HACKING: Every module that changed since
+ * the last flush gets a set-raw, set-masked (if only a few channels changed) or
+ * set-xyY frame, followed by a broadcast strobe. Modules with consecutive addresses
+ * that are sent completely share one set-bulk frame.
+ * LED-IDs are mapped to module-channels by a table that is filled with map_led().
+ *
+ * The device may be a serial port (which will be configured for 8N1 at the
+ * requested baudrate) or any other file, e.g. a pipe for testing. Plain files
+ * are only created if this is requested explicitly. The modules
+ * support 115200, 500000, 1000000 and 1500000 baud, but only 500000 with the
+ * standard-firmware.
+ *
+ * Note that using this class is NOT threadsafe.
+ */
+class bus_writer {
+	public:
+		
+		enum: unsigned {
+			/**
+			 * @brief the baudrate of the standard-firmware
+			 */
+			DEFAULT_BAUDRATE = 500000
+		};
+		
+		enum: uint8_t {
+			/**
+			 * @brief the address that all modules listen to
+			 */
+			BROADCAST = 0xff
+		};
+		
+		enum: std::size_t {
+			/**
+			 * @brief the number of PWM-channels per module
+			 */
+			MODULE_CHANNELS = 16,
+			
+			/**
+			 * @brief the number of calibrated RGB-LEDs per module (for set_xyY)
+			 */
+			MODULE_RGB_LEDS = MODULE_CHANNELS / 3
+		};
+		
+		/**
+		 * @brief the default constructor.
+		 *
+		 * Note that this is not properly constructed afterwards, so any
+		 * attempt of using it will result in a vlpp::uninitialized_error
+		 * beeing thrown.
+		 */
+		bus_writer() = default;
+		
+		/**
+		 * @brief Opens the device.
+		 * @param device the path of the device, e.g. "/dev/ttyUSB0"
+		 * @param baudrate the baudrate (115200, 500000, 1000000 or 1500000);
+		 *        ignored if the device is no terminal
+		 * @param create whether to create (or truncate) a plain file at device,
+		 *        e.g. to record the output
+		 * @throws std::invalid_argument if the baudrate is not supported
+		 * @throws vlpp::connection_failure if the device cannot be opened or configured
+		 */
+		bus_writer(const std::string& device, unsigned baudrate = DEFAULT_BAUDRATE,
+				bool create = false);
+		
+		/**
+		 * @brief move-ctor
+		 * @param other an rvalue-reference to another instance
+		 */
+		bus_writer(bus_writer&& other);
+		
+		/**
+		 * @brief Asigns an rvalue-instance to this.
+		 * @param the rvalue-instance
+		 * @return a reference to *this
+		 */
+		bus_writer& operator=(bus_writer&& other);
+		
+		/**
+		 * @brief closes the device.
+		 */
+		virtual ~bus_writer();
+		
+		/**
+		 * @brief Maps a virtual rgb-LED to three channels on the bus.
+		 *
+		 * An existing mapping of the LED will be replaced.
+		 *
+		 * @param led_id the ID of the LED
+		 * @param r the channel of the red part
+		 * @param g the channel of the green part
+		 * @param b the channel of the blue part
+		 * @throws std::invalid_argument if one of the addresses is invalid
+		 * @throws vlpp::uninitialized_error if this is not initialized correctly
+		 */
+		void map_led(uint16_t led_id, channel_address r, channel_address g, channel_address b);
+		
+		/**
+		 * @brief Sets a mapped LED to a color.
+		 *
+		 * The color is blended over the current value by its alpha-value.
+		 * LEDs that are not mapped are ignored.
+		 *
+		 * @param led_id the ID of the LED
+		 * @param col the new color of the LED
+		 * @throws vlpp::uninitialized_error if this is not initialized correctly
+		 */
+		void set_led(uint16_t led_id, const rgba_color& col);
+		
+		/**
+		 * @brief Sets a list of mapped LEDs to a specific color.
+		 * @param led_ids the IDs of the LEDs
+		 * @param col the new color of the LEDs
+		 * @throws vlpp::uninitialized_error if this is not initialized correctly
+		 */
+		void set_leds(const std::vector<uint16_t>& led_ids, const rgba_color& col);
+		
+		/**
+		 * @brief Sets the raw PWM-value of a single channel.
+		 * @param address the channel
+		 * @param value the new value
+		 * @throws std::invalid_argument if the address is invalid
+		 * @throws vlpp::uninitialized_error if this is not initialized correctly
+		 */
+		void set_channel(channel_address address, uint16_t value);
+		
+		/**
+		 * @brief Sets a calibrated LED of a module to a color in the xyY-space.
+		 *
+		 * Modules are either driven raw or by xyY; the module will be sent
+		 * in the mode of the last call that changed it.
+		 *
+		 * @param module the address of the module
+		 * @param led the LED on the module (0 to MODULE_RGB_LEDS-1)
+		 * @param x the x-coordinate
+		 * @param y the y-coordinate
+		 * @param Y the luminance
+		 * @throws std::invalid_argument if module or LED are invalid
+		 * @throws vlpp::uninitialized_error if this is not initialized correctly
+		 */
+		void set_xyY(uint8_t module, uint8_t led, uint16_t x, uint16_t y, uint16_t Y);
+		
+		/**
+		 * @brief Adds an arbitrary frame to the output.
+		 *
+		 * The payload will be escaped and is sent with the next flush,
+		 * before the module updates, or with the next send_frames().
+		 *
+		 * @param payload the frame-payload: the address followed by the command
+		 * @throws std::invalid_argument if the payload is empty
+		 * @throws vlpp::uninitialized_error if this is not initialized correctly
+		 */
+		void send_frame(const std::vector<uint8_t>& payload);
+		
+		/**
+		 * @brief Sends all changed modules and a strobe.
+		 * @throws vlpp::connection_failure if the write fails
+		 * @throws vlpp::uninitialized_error if this is not initialized correctly
+		 */
+		void flush();
+		
+		/**
+		 * @brief Sends only the frames added by send_frame(), without a strobe.
+		 *
+		 * On a serial port, this returns after the frames have been
+		 * transmitted, so that the caller can pace the bus.
+		 *
+		 * @throws vlpp::connection_failure if the write fails
+		 * @throws vlpp::uninitialized_error if this is not initialized correctly
+		 */
+		void send_frames();
+		
+	private:
+		// pimpl, like vlpp::client:
+		class bus_writer_impl;
+		bus_writer_impl* _impl = nullptr;
+};
+
+}//namespace vlpp
+
+
+#endif // BUS_WRITER_HPP
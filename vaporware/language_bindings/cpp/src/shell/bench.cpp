@@ -0,0 +1,115 @@
+/*
+ *  This file is part of vaporpp.
+ *
+ *  vaporpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vaporpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vaporpp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bench.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../lib/rgba_color.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+// more than this would not fit the microseconds-resolution of the report:
+const unsigned long MAX_FPS = 1000000;
+// keeps the end of the run far from overflowing bench_clock:
+const std::chrono::hours MAX_DURATION(24);
+// the latencies of longer runs are still recorded, just not preallocated:
+const std::size_t MAX_RESERVED_FRAMES = 1 << 20;
+
+long long to_us(bench_clock::duration d) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+} // anonymous namespace
+
+void bench(vlpp::client& client, std::size_t led_count, unsigned long fps,
+		std::chrono::seconds duration) {
+	if (led_count == 0 || led_count > UINT16_MAX + 1ul) {
+		throw std::invalid_argument("invalid number of LEDs");
+	}
+	if (fps == 0 || duration.count() <= 0) {
+		throw std::invalid_argument("the framerate and duration must be positive");
+	}
+	if (fps > MAX_FPS || duration > MAX_DURATION) {
+		throw std::invalid_argument("the framerate must not exceed 1000000 and the duration one day");
+	}
+	std::vector<uint16_t> LEDs(led_count);
+	std::iota(LEDs.begin(), LEDs.end(), 0);
+	
+	const bench_clock::duration frame_period = std::chrono::duration_cast<bench_clock::duration>(
+		std::chrono::seconds(1)) / fps;
+	std::vector<bench_clock::duration> latencies;
+	// fps is at most MAX_FPS, so this cannot overflow:
+	const unsigned long long frames = std::min<unsigned long long>(
+		duration.count(), MAX_RESERVED_FRAMES) * fps;
+	latencies.reserve(std::min<unsigned long long>(frames, MAX_RESERVED_FRAMES));
+	std::size_t stalls = 0;
+	uint8_t shade = 0;
+	
+	const auto start = bench_clock::now();
+	const auto end = start + duration;
+	auto next_frame = start;
+	while (next_frame < end) {
+		// change the color every frame, so that no frame is a no-op:
+		client.set_leds(LEDs, vlpp::rgba_color(shade, UINT8_MAX - shade, 0));
+		++shade;
+		
+		const auto before = bench_clock::now();
+		client.flush();
+		const auto latency = bench_clock::now() - before;
+		latencies.push_back(latency);
+		if (latency > frame_period) {
+			++stalls;
+		}
+		
+		next_frame += frame_period;
+		const auto now = bench_clock::now();
+		if (next_frame < now) {
+			// don't try to catch up, the report shows the lost frames:
+			next_frame = now;
+		}
+		else {
+			std::this_thread::sleep_until(next_frame);
+		}
+	}
+	const auto elapsed = bench_clock::now() - start;
+	
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&](unsigned p) {
+		return to_us(latencies[(latencies.size() - 1) * p / 100]);
+	};
+	const double seconds = std::chrono::duration<double>(elapsed).count();
+	std::cout << std::fixed << std::setprecision(1)
+		<< "frames: " << latencies.size() << " in " << seconds << "s, "
+		<< "achieved fps: " << latencies.size() / seconds << " of " << fps << '\n'
+		<< "flush-latency [µs]: p50 " << percentile(50)
+		<< ", p90 " << percentile(90)
+		<< ", p99 " << percentile(99)
+		<< ", max " << to_us(latencies.back()) << '\n'
+		<< "stalls (flush slower than " << to_us(frame_period) << "µs): " << stalls
+		<< std::endl;
+}
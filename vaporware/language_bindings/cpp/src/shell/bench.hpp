@@ -0,0 +1,48 @@
+/*
+ *  This file is part of vaporpp.
+ *
+ *  vaporpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vaporpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vaporpp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <chrono>
+#include <cstddef>
+
+#include "../lib/client.hpp"
+
+/**
+ * @brief Sends synthetic frames to the server and prints how well it kept up.
+ *
+ * Every frame sets the LEDs 0 to led_count-1 to a new color and is sent with
+ * client.flush(), just like the set-command does. The report contains the
+ * achieved framerate, percentiles of the time that flush() needed and the
+ * number of stalls (flushes that took longer than one frame period).
+ *
+ * Since the protocol has no replies, the measured latency is the time until
+ * the socket accepted the frame; a full send-buffer shows up as a stall.
+ *
+ * @param client the client that is used to send the frames
+ * @param led_count the number of LEDs in each frame
+ * @param fps the requested framerate
+ * @param duration how long to send frames
+ * @throws std::invalid_argument if any argument is zero or led_count, fps or duration is too big
+ * @throws vlpp::connection_failure if the connection breaks
+ */
+void bench(vlpp::client& client, std::size_t led_count, unsigned long fps,
+	std::chrono::seconds duration);
+
+#endif // BENCH_HPP
@@ -36,6 +36,8 @@ void print_cli_help(){
 		     "\tbuffers commands to set some leds to a color\n"
 		     "flush|f\n"
 		     "\texecutes the buffered commands\n"
+		     "bench <LED-count> <fps> <seconds>\n"
+		     "\tsends synthetic frames and reports the achieved fps and latencies\n"
 		     "quit|q\n"
 		     "\tquit the programm\n"
 		     "help|h\n"
@@ -18,8 +18,8 @@
 
 
 
+#include <cctype>
 #include <cstring>
-#include <sstream>
 #include <stdexcept>
 
 #include <readline/readline.h>
@@ -57,28 +57,60 @@ bool readln(std::string& line,const std::string& prompt) {
 }
 
 
+void split_words(const std::string& line, std::vector<std::string>& words) {
+	words.clear();
+	const char* it = line.data();
+	const char* end = it + line.size();
+	while (it != end) {
+		while (it != end && isspace((unsigned char)*it)) {
+			++it;
+		}
+		const char* word_begin = it;
+		while (it != end && !isspace((unsigned char)*it)) {
+			++it;
+		}
+		if (word_begin != it) {
+			words.emplace_back(word_begin, it);
+		}
+	}
+}
+
+
+unsigned long str_to_number(const std::string& str) {
+	std::size_t len = 0;
+	unsigned long returnvalue = 0;
+	// stoul would silently accept a sign:
+	if (str.empty() || !isdigit((unsigned char)str[0])) {
+		throw std::invalid_argument("not a number: “" + str + "”");
+	}
+	try {
+		returnvalue = std::stoul(str, &len);
+	}
+	catch (std::logic_error&) {
+		len = 0;
+	}
+	if (len == 0 || len != str.size()) {
+		throw std::invalid_argument("not a number: “" + str + "”");
+	}
+	return returnvalue;
+}
+
+
 std::pair< std::string, std::vector< std::string > > parse_cmd(
     const std::string& cmd,
     const std::map<std::string, std::string>& argmap
 ) {
-	using std::string;
-	std::istringstream stream(cmd);
-	string primary_command;
-	if (!stream.good()) {
+	std::vector<std::string> args;
+	split_words(cmd, args);
+	if (args.empty()) {
 		throw std::invalid_argument("empty commandline cannot be parsed");
 	}
-	stream >> primary_command;
+	std::string primary_command = args.front();
+	args.erase(args.begin());
 	auto tmp_it = argmap.find(primary_command);
 	if (tmp_it != argmap.end()) {
 		primary_command = tmp_it->second;
 	}
 	
-	std::vector<std::string> args;
-	std::string tmp;
-	while (stream.good()) {
-		stream >> tmp;
-		args.push_back(tmp);
-	}
-	
 	return std::make_pair(primary_command, args);
 }
@@ -38,6 +38,21 @@ void init_readln();
  */
 bool readln(std::string& line, const std::string& prompt);
 
+/**
+ * @brief splits a line into its whitespace-separated words
+ * @param line the line
+ * @param words the vector the words are written to; its old content is discarded
+ */
+void split_words(const std::string& line, std::vector<std::string>& words);
+
+/**
+ * @brief converts a string of decimal digits to a number
+ * @param str the string
+ * @return the number
+ * @throws std::invalid_argument if str is not a (non-negative) number
+ */
+unsigned long str_to_number(const std::string& str);
+
 /**
  * @brief parse a command
  * @param cmd the command from the commandline
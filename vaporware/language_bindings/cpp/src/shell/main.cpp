@@ -16,7 +16,9 @@
  */
 
 
+#include <chrono>
 #include <cstdint>
+#include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <map>
@@ -27,7 +29,9 @@
 #include "../lib/client.hpp"
 
 #include "console.hpp"
+#include "bench.hpp"
 #include "commands.hpp"
+#include "script.hpp"
 
 int main(int argc, char**argv) {
 	using std::string;
@@ -36,6 +40,7 @@ int main(int argc, char**argv) {
 	string server;
 	string token;
 	uint16_t port;
+	string batch_file;
 	
 	bpo::options_description desc;
 	desc.add_options()
@@ -43,7 +48,8 @@ int main(int argc, char**argv) {
 	("verbose,v", "be verbose")
 	("token,t", bpo::value<std::string>(&token), "sets the authentication-token")
 	("server,s", bpo::value<std::string>(&server), "sets the servername")
-	("port, p", bpo::value<uint16_t>(&port)->default_value(vlpp::client::DEFAULT_PORT), "sets the server-port");
+	("port, p", bpo::value<uint16_t>(&port)->default_value(vlpp::client::DEFAULT_PORT), "sets the server-port")
+	("batch,b", bpo::value<std::string>(&batch_file), "runs the commands from a file (“-” for stdin) instead of the interactive shell");
 	
 	bpo::variables_map vm;
 	bpo::store(bpo::parse_command_line(argc, argv, desc) ,vm);
@@ -59,6 +65,33 @@ int main(int argc, char**argv) {
 		          << "port = " << port << std::endl;
 	}
 	
+	if (vm.count("batch")) {
+		std::ifstream file;
+		if (batch_file != "-") {
+			file.open(batch_file);
+			if (!file) {
+				std::cerr << "Error: cannot open “" << batch_file << "”" << std::endl;
+				return 1;
+			}
+		}
+		try {
+			// parse everything before connecting, so that errors
+			// don't leave the LEDs in a half-finished state:
+			script batch(batch_file == "-" ? std::cin : file);
+			vlpp::client client(server, token, port);
+			batch.run(client);
+		}
+		catch (std::invalid_argument& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			return 1;
+		}
+		catch (std::runtime_error& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+	
 	vlpp::client client(server, token, port);
 	
 	string line;
@@ -103,6 +136,26 @@ int main(int argc, char**argv) {
 		else if(cmd.first == "flush"){
 			client.flush();
 		}
+		else if(cmd.first == "bench"){
+			if (cmd.second.size() != 3) {
+				std::cerr << "Error: “bench” takes exactly three arguments" << std::endl;
+				continue;
+			}
+			try {
+				bench(client, str_to_number(cmd.second[0]), str_to_number(cmd.second[1]),
+					std::chrono::seconds(str_to_number(cmd.second[2])));
+			}
+			catch
+				(std::invalid_argument& e) {
+				std::cerr << "Error: " << e.what() << std::endl;
+				continue;
+			}
+			catch
+				(std::runtime_error& e) {
+				std::cerr << "Error: " << e.what() << std::endl;
+				return 1;
+			}
+		}
 		else if(cmd.first == "help"){
 			print_cli_help();
 		}
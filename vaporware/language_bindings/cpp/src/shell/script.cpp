@@ -0,0 +1,190 @@
+/*
+ *  This file is part of vaporpp.
+ *
+ *  vaporpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vaporpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vaporpp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "script.hpp"
+
+#include <stdexcept>
+#include <thread>
+
+#include "../util/ids.hpp"
+
+#include "bench.hpp"
+#include "console.hpp"
+
+namespace {
+
+void check_argc(const std::vector<std::string>& words, std::size_t argc) {
+	if (words.size() != argc + 1) {
+		throw std::invalid_argument("“" + words[0] + "” takes exactly "
+			+ std::to_string(argc) + " argument(s)");
+	}
+}
+
+// the longest time that wait, at and bench accept; this keeps the times far
+// from overflowing std::chrono::milliseconds and steady_clock:
+const std::chrono::hours MAX_TIME(24);
+
+// parses a time in units of Duration and rejects it before the conversion
+// if it is longer than MAX_TIME:
+template<typename Duration>
+Duration str_to_time(const std::string& str) {
+	const unsigned long value = str_to_number(str);
+	const auto max = std::chrono::duration_cast<Duration>(MAX_TIME).count();
+	if (value > static_cast<unsigned long>(max)) {
+		throw std::invalid_argument("time out of range (at most one day): “" + str + "”");
+	}
+	return Duration(value);
+}
+
+} // anonymous namespace
+
+script::script(std::istream& input) {
+	std::string line;
+	std::vector<std::string> words;
+	std::size_t line_number = 0;
+	while (std::getline(input, line)) {
+		++line_number;
+		split_words(line, words);
+		if (words.empty() || words[0][0] == '#') {
+			continue;
+		}
+		try {
+			parse_line(words);
+		}
+		catch (std::invalid_argument& e) {
+			throw std::invalid_argument("line " + std::to_string(line_number)
+				+ ": " + e.what());
+		}
+	}
+	if (!_open_repeats.empty()) {
+		throw std::invalid_argument("missing “end” for “repeat”");
+	}
+}
+
+void script::parse_line(const std::vector<std::string>& words) {
+	const std::string& cmd = words[0];
+	instruction inst{};
+	if (cmd == "set" || cmd == "s" || cmd == "add" || cmd == "a") {
+		check_argc(words, 2);
+		inst.op = (cmd[0] == 's') ? opcode::SET : opcode::ADD;
+		inst.LEDs = str_to_ids(words[1]);
+		inst.color = vlpp::rgba_color(words[2]);
+	}
+	else if (cmd == "flush" || cmd == "f") {
+		check_argc(words, 0);
+		inst.op = opcode::FLUSH;
+	}
+	else if (cmd == "bench") {
+		check_argc(words, 3);
+		inst.op = opcode::BENCH;
+		inst.count = str_to_number(words[1]);
+		inst.fps = str_to_number(words[2]);
+		inst.time = str_to_time<std::chrono::seconds>(words[3]);
+	}
+	else if (cmd == "wait" || cmd == "w" || cmd == "at") {
+		check_argc(words, 1);
+		inst.op = (cmd == "at") ? opcode::AT : opcode::WAIT;
+		inst.time = str_to_time<std::chrono::milliseconds>(words[1]);
+	}
+	else if (cmd == "repeat" || cmd == "r") {
+		check_argc(words, 1);
+		inst.op = opcode::REPEAT;
+		inst.count = str_to_number(words[1]);
+		_open_repeats.push_back(_instructions.size());
+	}
+	else if (cmd == "end") {
+		check_argc(words, 0);
+		if (_open_repeats.empty()) {
+			throw std::invalid_argument("“end” without “repeat”");
+		}
+		inst.op = opcode::END;
+		inst.count = _open_repeats.back();
+		_open_repeats.pop_back();
+	}
+	else if (cmd == "auth" || cmd == "authenticate") {
+		check_argc(words, 1);
+		inst.op = opcode::AUTH;
+		inst.token = words[1];
+	}
+	else if (cmd == "quit" || cmd == "q") {
+		check_argc(words, 0);
+		inst.op = opcode::QUIT;
+	}
+	else {
+		throw std::invalid_argument("unknown command: “" + cmd + "”");
+	}
+	_instructions.push_back(std::move(inst));
+}
+
+void script::run(vlpp::client& client) const {
+	using std::chrono::steady_clock;
+	struct loop {
+		std::size_t remaining;
+		steady_clock::time_point start;
+	};
+	// the outermost entry is the script itself:
+	std::vector<loop> loops{{0, steady_clock::now()}};
+	
+	std::size_t pc = 0;
+	while (pc < _instructions.size()) {
+		const instruction& inst = _instructions[pc];
+		switch (inst.op) {
+			case opcode::SET:
+				client.set_leds(inst.LEDs, inst.color);
+				client.flush();
+				break;
+			case opcode::ADD:
+				client.set_leds(inst.LEDs, inst.color);
+				break;
+			case opcode::FLUSH:
+				client.flush();
+				break;
+			case opcode::BENCH:
+				bench(client, inst.count, inst.fps,
+					std::chrono::duration_cast<std::chrono::seconds>(inst.time));
+				break;
+			case opcode::WAIT:
+				std::this_thread::sleep_for(inst.time);
+				break;
+			case opcode::AT:
+				std::this_thread::sleep_until(loops.back().start + inst.time);
+				break;
+			case opcode::REPEAT:
+				loops.push_back({inst.count, steady_clock::now()});
+				break;
+			case opcode::END: {
+				loop& current = loops.back();
+				// a count of 0 means forever:
+				if (current.remaining == 0 || --current.remaining > 0) {
+					current.start = steady_clock::now();
+					pc = inst.count;
+				}
+				else {
+					loops.pop_back();
+				}
+				break;
+			}
+			case opcode::AUTH:
+				client.authenticate(inst.token);
+				break;
+			case opcode::QUIT:
+				return;
+		}
+		++pc;
+	}
+}
@@ -0,0 +1,96 @@
+/*
+ *  This file is part of vaporpp.
+ *
+ *  vaporpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vaporpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vaporpp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SCRIPT_HPP
+#define SCRIPT_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "../lib/client.hpp"
+#include "../lib/rgba_color.hpp"
+
+/**
+ * @brief A batch-script for the shell that is parsed once and can then be run
+ * without any further string-processing.
+ *
+ * Every line contains one command:
+ * - set|s, add|a, flush|f, bench, auth and quit|q work like in the interactive shell
+ * - wait|w <ms> sleeps for the given time
+ * - at <ms> sleeps until the given time after the start of the current
+ *   repeat-iteration (or of the script) has passed
+ * - the times of wait, at and bench must not exceed one day
+ * - repeat|r <n> … end repeats the enclosed commands n times (forever if n is 0);
+ *   repeats may be nested
+ *
+ * Empty lines and lines that start with '#' are ignored.
+ */
+class script {
+	public:
+		/**
+		 * @brief Reads and parses a whole script.
+		 * @param input the stream the script is read from
+		 * @throws std::invalid_argument if the script contains an error; the
+		 *         message contains the line-number
+		 */
+		explicit script(std::istream& input);
+		
+		/**
+		 * @brief Runs the script.
+		 * @param client the client that the commands are sent with
+		 * @throws vlpp::connection_failure if the connection breaks
+		 */
+		void run(vlpp::client& client) const;
+		
+	private:
+		enum class opcode {
+			SET,
+			ADD,
+			FLUSH,
+			BENCH,
+			WAIT,
+			AT,
+			REPEAT,
+			END,
+			AUTH,
+			QUIT
+		};
+		
+		struct instruction {
+			opcode op;
+			std::vector<uint16_t> LEDs;
+			vlpp::rgba_color color;
+			std::chrono::milliseconds time;
+			// REPEAT: the number of iterations, END: the index of the REPEAT,
+			// BENCH: the number of LEDs
+			std::size_t count;
+			unsigned long fps;
+			std::string token;
+		};
+		
+		void parse_line(const std::vector<std::string>& words);
+		
+		std::vector<instruction> _instructions;
+		std::vector<std::size_t> _open_repeats;
+};
+
+#endif // SCRIPT_HPP
@@ -5,79 +5,229 @@
 #include "fixedpoint.h"
 #include "term.h"
 
-static void mat_x_vec(fixed_t m[static 9], fixed_t x[static 3], fixed_t result[static 3]) {
-	result[0] = fixadd3(fixmul(m[0], x[0]), fixmul(m[1], x[1]), fixmul(m[2], x[2]));
-	result[1] = fixadd3(fixmul(m[3], x[0]), fixmul(m[4], x[1]), fixmul(m[5], x[2]));
-	result[2] = fixadd3(fixmul(m[6], x[0]), fixmul(m[7], x[1]), fixmul(m[8], x[2]));
-}
+/*
+ * The color correction info of one LED, as prepared by
+ * color_prepare(). Unlike led_info_t, this is not packed, so the
+ * values can be loaded with single aligned accesses.
+ */
+typedef struct {
+	// The raw values of led_info_t.color_matrix.
+	int32_t matrix[9];
+	// The raw values of led_info_t.peak_Y.
+	int32_t peak_Y[3];
+} color_info_t;
 
-static fixed_t dot(fixed_t a[static 3], fixed_t b[static 3]) {
-	return fixadd3(fixmul(a[0], b[0]),
-		       fixmul(a[1], b[1]),
-		       fixmul(a[2], b[2]));
+static color_info_t color_infos[RGB_LED_COUNT];
+
+/*
+ * The gamma in 1/100 and, if the config page has one for it, the
+ * table of 16 bit PWM values for all 8 bit values, as prepared by
+ * color_prepare().
+ */
+static uint16_t current_gamma;
+static const uint16_t *gamma_lut;
+
+/*
+ * 2^(2^-k) for k = 1 to 16 with 30 fractional bits, for exp2_q16().
+ */
+static const uint32_t EXP2_ROOTS[16] = {
+	1518500250,
+	1276901417,
+	1170923762,
+	1121280436,
+	1097253708,
+	1085434106,
+	1079572136,
+	1076653033,
+	1075196443,
+	1074468888,
+	1074105294,
+	1073923544,
+	1073832680,
+	1073787251,
+	1073764537,
+	1073753181
+};
+
+/*
+ * Multiplies two raw fixed point values.
+ */
+static inline int32_t mul_raw(int32_t a, int32_t b) {
+	return (int32_t) (((int64_t) a * b) >> FRAC_BITS);
 }
 
-static fixed_t clamp(fixed_t x, fixed_t min, fixed_t max) {
-	if (fixlt(x, min)) {
-		return min;
-	} else if (fixgt(x, max)) {
-		return max;
+/*
+ * Clamps a raw fixed point value to [0.0, 1.0].
+ */
+static inline uint32_t clamp_unit(int32_t a) {
+	if (a < 0) {
+		return 0;
+	} else if (a > (1 << FRAC_BITS)) {
+		return 1 << FRAC_BITS;
 	} else {
-		return x;
+		return a;
 	}
 }
 
 /*
- * Performs color correction according to the given led_info_t.
+ * Returns log2(x) with 16 fractional bits, for x > 0.
+ *
+ * The fractional bits are found one by one by squaring the mantissa.
+ */
+static int32_t log2_q16(uint32_t x) {
+	int n = 31 - __builtin_clz(x);
+	// Mantissa in [1, 2) with 30 fractional bits.
+	uint64_t m = ((uint64_t) x << 30) >> n;
+	int32_t result = n << 16;
+
+	for (int bit = 15; bit >= 0; bit--) {
+		m = (m * m) >> 30;
+		if (m >= (2ULL << 30)) {
+			m >>= 1;
+			result |= 1 << bit;
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Returns 65535 * 2^x, rounded, for x <= 0 given with 16 fractional
+ * bits.
+ */
+static uint16_t exp2_q16(int32_t x) {
+	// x = n + f with integer n <= 0 and f in [0, 1).
+	int n = x >> 16;
+	uint32_t f = x & 0xffff;
+
+	if (n < -16) {
+		return 0;
+	}
+
+	// 2^f as the product of 2^(2^-k) for each bit k of f.
+	uint64_t r = 1 << 30;
+	for (int k = 0; k < 16; k++) {
+		if (f & (0x8000 >> k)) {
+			r = (r * EXP2_ROOTS[k]) >> 30;
+		}
+	}
+
+	uint64_t y = (r * 65535) >> (29 - n);
+	return (y + 1) >> 1;
+}
+
+/*
+ * Prepares the color correction and looks up the gamma table for the
+ * current configuration. This must be called whenever the color correction
+ * info or the gamma in config changes, before color_correct or
+ * color_expand are used.
+ */
+void color_prepare() {
+	for (int l = 0; l < RGB_LED_COUNT; l++) {
+		for (int i = 0; i < 9; i++) {
+			color_infos[l].matrix[i] = config.led_infos[l].color_matrix[i].v;
+		}
+		for (int i = 0; i < 3; i++) {
+			color_infos[l].peak_Y[i] = config.led_infos[l].peak_Y[i].v;
+		}
+	}
+
+	current_gamma = config.gamma ? config.gamma : DEFAULT_GAMMA;
+	gamma_lut = config_gamma_lut(current_gamma);
+}
+
+/*
+ * Computes the 16 bit PWM value of an 8 bit value for the given
+ * gamma in 1/100.
+ */
+uint16_t color_gamma(uint16_t gamma, uint8_t value) {
+	if (value == 0) {
+		return 0;
+	}
+
+	// (v / 255)^gamma = 2^(gamma * log2(v / 255))
+	int32_t exponent = ((int64_t) (log2_q16(value) - log2_q16(255)) * gamma) / 100;
+	return exp2_q16(exponent);
+}
+
+/*
+ * Expands an 8 bit value to a 16 bit PWM value using the configured
+ * gamma. This is a table lookup once the configuration has been saved
+ * (see save_config), and much slower before.
+ */
+uint16_t color_expand(uint8_t value) {
+	if (gamma_lut) {
+		return gamma_lut[value];
+	}
+
+	return color_gamma(current_gamma, value);
+}
+
+/*
+ * Performs color correction for the given LED.
  *
  * This function converts the color given in x, y, Y to the
  * appropriate PWM channel settings for the LED with the given
- * led_info_t. The settings are returned through *r, *g, *b.
+ * index. The settings are returned through rgb.
  */
-void color_correct(led_info_t info,
+void color_correct(uint8_t led,
 		   uint16_t x, uint16_t y, uint16_t Y,
 		   uint16_t rgb[static 3]) {
+	const color_info_t *info = &color_infos[led];
 
 	// First, get the ratio of the PWM channels right.  This is
 	// done by finding the barycentric coordinates of xyY within
-	// the LED's gamut.
-	// info already contains the inverted matrix
-	// necessary to compute this.
+	// the LED's gamut, i.e. by multiplying (x, y, 1) with the
+	// color matrix.
+	// The desired color is approximated with one that is actually
+	// in the gamut (i.e. 0 <= ratio[i] <= 1).
+	// TODO This does not actually find the closest match.
+	uint32_t ratio[3];
+	uint32_t max_ratio = 0;
+	int32_t total_Y = 0;
 
-	fixed_t in[3] = {
-		fixfract(x),
-		fixfract(y),
-		FIXNUM(1.0)
-	};
-	fixed_t rgb_ratio[3];
+	for (int i = 0; i < 3; i++) {
+		const int32_t *row = &info->matrix[3 * i];
+		int32_t r = (int32_t) ((((int64_t) row[0] * x) + ((int64_t) row[1] * y)) >> FRAC_BITS) + row[2];
 
-	mat_x_vec(info.color_matrix, in, rgb_ratio);
+		ratio[i] = clamp_unit(r);
+		if (ratio[i] > max_ratio) {
+			max_ratio = ratio[i];
+		}
+		total_Y += mul_raw(ratio[i], info->peak_Y[i]);
+	}
 
-	// Approximate the desired color with one that is actually
-	// in the gamut (i.e. 0 <= rgb_ratio[i] <= 1).
-	// TODO This does not actually find the closest match.
-	for (int i = 0; i < 3; i++) {
-		rgb_ratio[i] = clamp(rgb_ratio[i], FIXNUM(0.0), FIXNUM(1.0));
+	if (max_ratio == 0 || total_Y <= 0) {
+		rgb[0] = rgb[1] = rgb[2] = 0;
+		return;
 	}
 
-	// Now adjust for the desired luminosity.
+	// Now adjust for the desired luminosity, i.e. scale by
+	// Y / total_Y.
 	// Note that the color takes precedence: If reproducing the
-	// color at the requested luminosity it not possible, it will
-	// be reproduced darker.
-	fixed_t total_Y = dot(rgb_ratio, info.peak_Y);
-
-	fixed_t scale = fixdiv(fixnum(Y), total_Y);
-
-	for (int i = 0; i < 2; i++) {
-		if (fixne(rgb_ratio[i], FIXNUM(0.0))) {
-			scale = fixmin(scale,
-				       fixdiv(FIXNUM(1.0), rgb_ratio[i]));
+	// color at the requested luminosity it not possible (because a
+	// channel would exceed 1.0), it will be reproduced darker, with
+	// the brightest channel at 1.0.
+	// Comparing Y / total_Y with 1 / max_ratio is done by cross
+	// multiplication, so only one reciprocal is needed.
+	uint32_t numerator[3];
+	fixrecip_t scale;
+	if ((uint32_t) Y * max_ratio <= (uint32_t) total_Y) {
+		scale = fixrecip(total_Y);
+		for (int i = 0; i < 3; i++) {
+			numerator[i] = ratio[i] * Y;
+		}
+	} else {
+		scale = fixrecip(max_ratio);
+		for (int i = 0; i < 3; i++) {
+			numerator[i] = ratio[i];
 		}
 	}
 
 	for (int i = 0; i < 3; i++) {
-		rgb_ratio[i] = fixmul(rgb_ratio[i], scale);
-		rgb[i] = fix_fract_part(rgb_ratio[i]);
+		uint32_t value = fixmul_recip(numerator[i], scale);
+		// 1.0 is the maximum PWM setting.
+		rgb[i] = value > 0xffff ? 0xffff : value;
 	}
 }
 
@@ -101,16 +251,17 @@ uint8_t convert_channel_index(uint8_t c) {
  * matrix pointed to by out.
  */
 void invert_3x3(fixed_t in[static 9], fixed_t out[static 9]) {
-	fixed_t invdet =
-		fixdiv(FIXNUM(1.0),
-		       fixadd3(
-			              fixmul(in[0], fixsub(fixmul(in[8],in[4]), fixmul(in[7],in[5]))),
-			       fixneg(fixmul(in[3], fixsub(fixmul(in[8],in[1]), fixmul(in[7],in[2])))),
-			              fixmul(in[6], fixsub(fixmul(in[5],in[1]), fixmul(in[4],in[2])))));
-
-	out[0] = fixmul(invdet,        fixsub(fixmul(in[8],in[4]), fixmul(in[7],in[5])));
-	out[1] = fixmul(invdet, fixneg(fixsub(fixmul(in[8],in[1]), fixmul(in[7],in[2]))));
-	out[2] = fixmul(invdet,        fixsub(fixmul(in[5],in[1]), fixmul(in[4],in[2])));
+	// The cofactors of the first column are needed for the
+	// determinant as well.
+	fixed_t c0 =        fixsub(fixmul(in[8],in[4]), fixmul(in[7],in[5]));
+	fixed_t c1 = fixneg(fixsub(fixmul(in[8],in[1]), fixmul(in[7],in[2])));
+	fixed_t c2 =        fixsub(fixmul(in[5],in[1]), fixmul(in[4],in[2]));
+
+	fixed_t invdet = fixinv(fixadd3(fixmul(in[0], c0), fixmul(in[3], c1), fixmul(in[6], c2)));
+
+	out[0] = fixmul(invdet, c0);
+	out[1] = fixmul(invdet, c1);
+	out[2] = fixmul(invdet, c2);
 	out[3] = fixmul(invdet, fixneg(fixsub(fixmul(in[8],in[3]), fixmul(in[6],in[5]))));
 	out[4] = fixmul(invdet,        fixsub(fixmul(in[8],in[0]), fixmul(in[6],in[2])));
 	out[5] = fixmul(invdet, fixneg(fixsub(fixmul(in[5],in[0]), fixmul(in[3],in[2]))));
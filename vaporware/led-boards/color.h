@@ -6,13 +6,34 @@
 #include "config.h"
 
 /*
- * Performs color correction accoring to the given led_info_t.
+ * Prepares the color correction and looks up the gamma table for the
+ * current configuration. This must be called whenever the color correction
+ * info or the gamma in config changes, before color_correct or
+ * color_expand are used.
+ */
+void color_prepare();
+
+/*
+ * Computes the 16 bit PWM value of an 8 bit value for the given
+ * gamma in 1/100.
+ */
+uint16_t color_gamma(uint16_t gamma, uint8_t value);
+
+/*
+ * Expands an 8 bit value to a 16 bit PWM value using the configured
+ * gamma. This is a table lookup once the configuration has been saved
+ * (see save_config), and much slower before.
+ */
+uint16_t color_expand(uint8_t value);
+
+/*
+ * Performs color correction for the given LED.
  *
  * This function converts the color given in x, y, Y to the
  * appropriate PWM channel settings for the LED with the given
- * led_info_t. The settings are returned through *r, *g, *b.
+ * index. The settings are returned through rgb.
  */
-void color_correct(led_info_t info,
+void color_correct(uint8_t led,
 		   uint16_t x, uint16_t y, uint16_t Y,
 		   uint16_t rgb[static 3]);
 
@@ -4,9 +4,14 @@
 #include "config.h"
 #include "console.h"
 #include "debug.h"
+#include "effect.h"
+#include "event.h"
+#include "fade.h"
 #include "pwm.h"
+#include "stats.h"
 #include "usart2.h"
 #include "term.h"
+#include "update.h"
 
 /*
  * The broadcast address.
@@ -16,14 +21,44 @@ static const uint8_t BROADCAST = 0xff;
 typedef enum {
 	CMD_SET_RAW = 0x00,
 	CMD_SET_XYY = 0x01,
+	CMD_SET_MASKED = 0x02,
+	CMD_SET_BULK = 0x03,
+	CMD_FADE = 0x04,
+	CMD_SET_RAW8 = 0x05,
+	CMD_EFFECT = 0x06,
+	CMD_UPDATE = UPDATE_START,
+	CMD_UPDATE_CHUNK = UPDATE_CHUNK,
+	CMD_UPDATE_END = UPDATE_END,
 	CMD_STROBE = 0xff
 } commant_t;
 
+/*
+ * Counts the number of set bits in a channel mask.
+ */
+static inline int mask_popcount(uint16_t mask) {
+	int bits;
+
+	for (bits = 0; mask != 0; bits++) {
+		mask &= mask - 1;
+	}
+
+	return bits;
+}
+
+/*
+ * Stops a running fade or effect where it is, so that set commands
+ * change the values shown.
+ */
+static void stop_animation() {
+	fade_stop();
+	effect_stop();
+}
+
 /*
  * The USART address filter function.
  *
- * This function accepts the address of the module, the broadcast
- * address and all special commands.
+ * This function accepts the address of the module, its group
+ * addresses, the broadcast address and all special commands.
  */
 static bool address_filter(uint8_t address) {
 #ifdef TRACE_USART
@@ -31,8 +66,61 @@ static bool address_filter(uint8_t address) {
 	debug_putchar(config.my_address);
 #endif
 
-	return address == config.my_address ||
-		address == BROADCAST;
+	if (address == config.my_address || address == BROADCAST) {
+		return true;
+	}
+
+	for (int g = 0; g < GROUP_COUNT; g++) {
+		if (address == config.groups[g]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Set while a set-raw or bulk command is being decoded by the length
+ * check.
+ */
+static bool decoding = false;
+
+/*
+ * Set once all values of the set-raw or bulk command decoded by the
+ * length check have arrived. The main loop then makes them current
+ * with command_apply_decoded.
+ */
+static volatile bool decoded_complete = false;
+
+/*
+ * Decodes the values of a set-raw or bulk command in the ISR. header
+ * is the number of bytes before the values. Each channel is written
+ * to the back set of PWM values (see pwm_back_values) as soon as both
+ * of its bytes have arrived. Once all have arrived, the main loop is
+ * told to swap them in.
+ *
+ * The main loop only swaps the sets while decoded_complete is set,
+ * and decoding only starts while it is not, so the back set is never
+ * in use by both. If the command is aborted, the back set is simply
+ * overwritten by the next one.
+ */
+static int decode_raw(uint8_t *command, int header, int length_so_far) {
+	int value_length = length_so_far - header;
+
+	if (value_length > 0) {
+		uint8_t c = value_length / 2 - 1;
+		pwm_back_values()[convert_channel_index(c)] =
+			(command[length_so_far - 2] << 8) + command[length_so_far - 1];
+	}
+
+	if (value_length == sizeof(uint16_t) * MODULE_LENGTH) {
+		decoding = false;
+		decoded_complete = true;
+		event_post(EVENT_COMMAND);
+		return USART_DISCARD;
+	}
+
+	return sizeof(uint16_t);
 }
 
 /*
@@ -41,8 +129,17 @@ static bool address_filter(uint8_t address) {
  * This function checks the first byte of command_prefix (which is the
  * command code) and calculates the remaining bytes necessary from the
  * fixed length of each command.
+ *
+ * Of a bulk command, only the part for this module is stored: the
+ * command code, first address and count are followed by the values
+ * of this module, just like in set-raw.
+ *
+ * If the receiver is idle when a set-raw or bulk command starts, and
+ * the values of the last decoded command have been applied, its
+ * values are decoded as they arrive, see decode_raw. The command is
+ * then discarded instead of being queued.
  */
-static int length_check(uint8_t *command_prefix, int length_so_far) {
+static int length_check(uint8_t *command_prefix, int length_so_far, int *skip) {
 	if (length_so_far == 0) {
 		// This should not even happen, but better be prepared.
 		// We want to see at least the command code.
@@ -53,11 +150,64 @@ static int length_check(uint8_t *command_prefix, int length_so_far) {
 		int total_length;
 		switch(cmd_code) {
 		case CMD_SET_RAW:
+			if (length_so_far == 1) {
+				decoding = usart2_is_idle() && !decoded_complete;
+			}
+			if (decoding) {
+				return decode_raw(command_prefix, 1, length_so_far);
+			}
 			total_length = 1 + (sizeof(uint16_t) * MODULE_LENGTH);
 			break;
 		case CMD_SET_XYY:
 			total_length = 1 + (sizeof(uint16_t) * 3 * RGB_LED_COUNT);
 			break;
+		case CMD_SET_MASKED:
+			if (length_so_far < (int) (1 + sizeof(uint16_t))) {
+				// Wait for the mask first.
+				total_length = 1 + sizeof(uint16_t);
+			} else {
+				uint16_t mask = (command_prefix[1] << 8) + command_prefix[2];
+				total_length = 1 + sizeof(uint16_t) * (1 + mask_popcount(mask));
+			}
+			break;
+		case CMD_SET_BULK:
+			if (length_so_far < 3) {
+				// Wait for first address and count.
+				total_length = 3;
+			} else {
+				int index = config.my_address - command_prefix[1];
+				if (index < 0 || index >= command_prefix[2]) {
+					// This module is not part of the command.
+					return USART_DISCARD;
+				}
+				if (length_so_far == 3) {
+					// Drop the values of the modules before this one.
+					*skip = index * sizeof(uint16_t) * MODULE_LENGTH;
+					decoding = usart2_is_idle() && !decoded_complete;
+				}
+				if (decoding) {
+					return decode_raw(command_prefix, 3, length_so_far);
+				}
+				total_length = 3 + (sizeof(uint16_t) * MODULE_LENGTH);
+			}
+			break;
+		case CMD_SET_RAW8:
+			total_length = 1 + MODULE_LENGTH;
+			break;
+		case CMD_FADE:
+			total_length = 1 + sizeof(uint16_t) + 1 + (sizeof(uint16_t) * MODULE_LENGTH);
+			break;
+		case CMD_EFFECT:
+			total_length = 1 + 1 + (sizeof(uint16_t) * 3);
+			break;
+		case CMD_UPDATE:
+			total_length = 1 + 2 + sizeof(uint16_t) + sizeof(uint32_t);
+			break;
+		case CMD_UPDATE_CHUNK:
+		case CMD_UPDATE_END:
+			// Only of interest during an update, which
+			// receives them by itself.
+			return USART_DISCARD;
 		case CMD_STROBE:
 			total_length = 1;
 			break;
@@ -72,13 +222,86 @@ static int length_check(uint8_t *command_prefix, int length_so_far) {
 	}
 }
 
+/*
+ * The mask of the (flatly counted) channels that are mapped to the PWM
+ * channels a set-xyY command writes. Computed by command_init from the
+ * configured channel mapping.
+ */
+static uint16_t xyy_channels = 0;
+
+/*
+ * Returns the mask of the (flatly counted) channels set by a command.
+ * Returns 0 for commands that are not set commands.
+ */
+static uint16_t channels_set(uint8_t *command) {
+	switch (command[0]) {
+	case CMD_SET_RAW:
+	case CMD_SET_RAW8:
+	case CMD_SET_BULK:
+		return 0xffff;
+	case CMD_SET_XYY:
+		return xyy_channels;
+	case CMD_SET_MASKED:
+		return (command[1] << 8) + command[2];
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The USART merge check function.
+ *
+ * A set command replaces earlier set commands whose channels it all
+ * sets again, a fade replaces an earlier fade and an effect replaces
+ * an earlier effect. Strobes are barriers, so only commands for the
+ * same frame are merged unless the buffers run out.
+ */
+static usart_merge_t merge_check(uint8_t *newer, uint8_t *older) {
+	if (older[0] == CMD_STROBE) {
+		return USART_BARRIER;
+	}
+
+	if (newer[0] == CMD_FADE && older[0] == CMD_FADE) {
+		return USART_REPLACE;
+	}
+
+	if (newer[0] == CMD_EFFECT && older[0] == CMD_EFFECT) {
+		return USART_REPLACE;
+	}
+
+	uint16_t newer_channels = channels_set(newer);
+	uint16_t older_channels = channels_set(older);
+
+	if (older_channels != 0 && (older_channels & ~newer_channels) == 0) {
+		return USART_REPLACE;
+	} else {
+		return USART_KEEP;
+	}
+}
+
 /*
  * Initializes the command module and sets up the USART filter
- * appropriately.
+ * appropriately. Must be called after the configuration is final.
  */
 void command_init() {
+	// set-xyY writes the channels of the RGB LEDs by their PWM
+	// index, so find the flat channels that are mapped to those.
+	xyy_channels = 0;
+	for (uint8_t c = 0; c < MODULE_LENGTH; c++) {
+		uint8_t pwm_channel = convert_channel_index(c);
+
+		for (int l = 0; l < RGB_LED_COUNT; l++) {
+			for (int k = 0; k < 3; k++) {
+				if (config.led_infos[l].channels[k] == pwm_channel) {
+					xyy_channels |= 1 << c;
+				}
+			}
+		}
+	}
+
 	usart2_set_address_filter(address_filter);
 	usart2_set_length_check(length_check);
+	usart2_set_merge_check(merge_check);
 }
 
 /*
@@ -88,6 +311,8 @@ static error_t run_set_raw(uint8_t *args) {
 #ifdef TRACE_COMMANDS
 	console_write("raw");
 #endif
+	// Setting values stops a running fade or effect where it is.
+	stop_animation();
 	int i = 0;
 
 	for (uint8_t c = 0; c < MODULE_LENGTH; c++, i+=2) {
@@ -102,6 +327,55 @@ static error_t run_set_raw(uint8_t *args) {
 	return E_SUCCESS;
 }
 
+/*
+ * Runs a "set LEDs raw with 8 bits" command. The values are expanded
+ * to 16 bits with the configured gamma.
+ */
+static error_t run_set_raw8(uint8_t *args) {
+#ifdef TRACE_COMMANDS
+	console_write("raw8");
+#endif
+	stop_animation();
+
+	for (uint8_t c = 0; c < MODULE_LENGTH; c++) {
+		uint8_t pwm_channel = convert_channel_index(c);
+
+		error_t error = pwm_set_brightness(pwm_channel, color_expand(args[c]));
+
+		if (error) return error;
+	}
+
+	return E_SUCCESS;
+}
+
+/*
+ * Runs a "set some LEDs raw" command. The first two bytes are a mask
+ * of the channels that are set, followed by the values of those
+ * channels only.
+ */
+static error_t run_set_masked(uint8_t *args) {
+#ifdef TRACE_COMMANDS
+	console_write("masked");
+#endif
+	stop_animation();
+	uint16_t mask = (args[0] << 8) + args[1];
+	int i = 2;
+
+	for (uint8_t c = 0; c < MODULE_LENGTH; c++) {
+		if (!(mask & (1 << c))) continue;
+
+		uint16_t value = (args[i] << 8) + args[i+1];
+		i += 2;
+		uint8_t pwm_channel = convert_channel_index(c);
+
+		error_t error = pwm_set_brightness(pwm_channel, value);
+
+		if (error) return error;
+	}
+
+	return E_SUCCESS;
+}
+
 /*
  * Runs a "set LEDs xyY" command.
  */
@@ -109,20 +383,19 @@ static error_t run_set_xyY(uint8_t *args) {
 #ifdef TRACE_COMMANDS
 	console_write("xyY");
 #endif
+	stop_animation();
 #ifdef COUNT_SET_LEDS
 	cycle_start();
 #endif
 
 	int i = 0;
 	for (uint8_t l = 0; l < RGB_LED_COUNT; l++, i+=6) {
-		led_info_t info = config.led_infos[l];
-
 		uint16_t x = (args[i+0] << 8) + args[i+1];
 		uint16_t y = (args[i+2] << 8) + args[i+3];
 		uint16_t Y = (args[i+4] << 8) + args[i+5];
 
 		uint16_t rgb[3];
-		color_correct(info, x, y, Y, rgb);
+		color_correct(l, x, y, Y, rgb);
 
 #ifdef TRACE_COMMANDS
 		console_uint_d(l); console_write(" ");
@@ -135,7 +408,7 @@ static error_t run_set_xyY(uint8_t *args) {
 #endif
 
 		for (int c = 0; c < 3; c++) {
-			error_t error = pwm_set_brightness(info.channels[c], rgb[c]);
+			error_t error = pwm_set_brightness(config.led_infos[l].channels[c], rgb[c]);
 			if (error) return error;
 		}
 	}
@@ -153,11 +426,76 @@ static error_t run_set_xyY(uint8_t *args) {
 }
 
 /*
- * Runs the command pointed to by 'command'.
+ * Runs a "fade" command. The duration (in ms) and curve are followed
+ * by the target values, like in set-raw. The fade starts with the next
+ * strobe.
+ */
+static error_t run_fade(uint8_t *args) {
+#ifdef TRACE_COMMANDS
+	console_write("fade");
+#endif
+	uint16_t duration = (args[0] << 8) + args[1];
+	uint8_t curve = args[2];
+	uint16_t targets[MODULE_LENGTH];
+	int i = 3;
+
+	for (uint8_t c = 0; c < MODULE_LENGTH; c++, i+=2) {
+		uint8_t pwm_channel = convert_channel_index(c);
+
+		if (pwm_channel >= MODULE_LENGTH) return E_INDEXRANGE;
+
+		targets[pwm_channel] = (args[i] << 8) + args[i+1];
+	}
+
+	// A fade stops a running effect like a set command.
+	effect_stop();
+
+	return fade_prepare(duration, curve, targets);
+}
+
+/*
+ * Runs an "effect" command. The effect type is followed by the period
+ * (in ms), the phase step per address and the level. The effect
+ * starts with the next strobe.
+ */
+static error_t run_effect(uint8_t *args) {
+#ifdef TRACE_COMMANDS
+	console_write("effect");
+#endif
+	uint8_t type = args[0];
+	uint16_t period = (args[1] << 8) + args[2];
+	uint16_t phase_step = (args[3] << 8) + args[4];
+	uint16_t level = (args[5] << 8) + args[6];
+
+	return effect_prepare(type, period, phase_step, level);
+}
+
+/*
+ * Runs an "update" command. Two magic bytes guard against starting an
+ * update by accident. They are followed by the number of chunks and
+ * the CRC of the new firmware image. Does not return unless the
+ * command is invalid or the module already runs this image.
+ */
+static error_t run_update(uint8_t *args) {
+#ifdef TRACE_COMMANDS
+	console_write("update");
+#endif
+	if (args[0] != 'V' || args[1] != 'L') {
+		return E_WRONGCOMMAND;
+	}
+
+	uint16_t chunks = (args[2] << 8) + args[3];
+	uint32_t crc = ((uint32_t) args[4] << 24) + (args[5] << 16) + (args[6] << 8) + args[7];
+
+	return update_start(chunks, crc);
+}
+
+/*
+ * Runs the command pointed to by 'command' according to its code.
  *
  * Returns an error/success code.
  */
-error_t run_command(uint8_t *command) {
+static error_t dispatch_command(uint8_t *command) {
 	switch(command[0]) {
 	case CMD_SET_RAW:
 		return run_set_raw(command + 1);
@@ -165,13 +503,68 @@ error_t run_command(uint8_t *command) {
 	case CMD_SET_XYY:
 		return run_set_xyY(command + 1);
 		break;
+	case CMD_SET_MASKED:
+		return run_set_masked(command + 1);
+		break;
+	case CMD_SET_BULK:
+		// Only this module's values have been stored.
+		return run_set_raw(command + 3);
+		break;
+	case CMD_FADE:
+		return run_fade(command + 1);
+		break;
+	case CMD_SET_RAW8:
+		return run_set_raw8(command + 1);
+		break;
+	case CMD_EFFECT:
+		return run_effect(command + 1);
+		break;
+	case CMD_UPDATE:
+		return run_update(command + 1);
+		break;
 	case CMD_STROBE:
 #ifdef TRACE_COMMANDS
 		console_write("!");
 #endif
-		return pwm_send_frame();
+		stats.strobes++;
+		return effect_strobe();
 		break;
 	default:
 		return E_WRONGCOMMAND;
 	}
 }
+
+/*
+ * Makes the values of a set-raw or bulk command that was decoded
+ * while it was received current, if all of them have arrived. Like
+ * set-raw, this stops a running fade or effect where it is. Must be
+ * called by the main loop on EVENT_COMMAND, before it runs the next
+ * command.
+ */
+void command_apply_decoded() {
+	if (!decoded_complete) {
+		return;
+	}
+
+	stop_animation();
+	pwm_swap_values();
+
+	// Only now may the length check decode the next command.
+	decoded_complete = false;
+}
+
+/*
+ * Runs the command pointed to by 'command' and records its cycle
+ * count in the statistics. A decoded command (see
+ * command_apply_decoded) arrived before, so it is applied first.
+ *
+ * Returns an error/success code.
+ */
+error_t run_command(uint8_t *command) {
+	uint32_t start = cycle_get();
+	command_apply_decoded();
+	error_t error = dispatch_command(command);
+	stats_command(cycle_get() - start);
+
+	return error;
+}
@@ -15,7 +15,7 @@ typedef enum {
 
 /*
  * Initializes the command module and sets up the USART filter
- * appropriately.
+ * appropriately. Must be called after the configuration is final.
  */
 void command_init();
 
@@ -27,6 +27,15 @@ void command_init();
  */
 int command_length(char command_code);
 
+/*
+ * Makes the values of a set-raw or bulk command that was decoded
+ * while it was received current, if all of them have arrived. Like
+ * set-raw, this stops a running fade or effect where it is. Must be
+ * called by the main loop on EVENT_COMMAND, before it runs the next
+ * command.
+ */
+void command_apply_decoded();
+
 /*
  * Runs the command pointed to by 'command'. How the command is interpreted
  * depends on which mode the LED board is in.
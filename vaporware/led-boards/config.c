@@ -1,5 +1,6 @@
 #include "config.h"
 
+#include "color.h"
 #include "console.h"
 #include "debug.h"
 #include "flash.h"
@@ -105,31 +106,80 @@ config_entry_t config = {
 			}
 		}
 	},
+	.groups = REPEAT(GROUP_NONE, GROUP_COUNT),
 };
 
 /*
  * The configuration page. This is laid out in the following way:
- * There is a number of configuration slots, used one after the other
+ * The first halfword is the layout version, CONFIG_VERSION once the
+ * page has been written by this firmware. Then there is a number of
+ * configuration slots, used one after the other
  * for storing a configuration. The state of each slot is kept in
  * entry_status, where 0xffff (the flash default value) stands for a free
  * slot, 0x5555 for the slot currently in use and 0x0000 for an old slot.
  * When all slots are used, the config page is erased and the process
  * starts again.
  *
+ * The page also holds the table for expanding 8 bit values (see
+ * color_expand) for the gamma in gamma_lut_gamma, so that it need not
+ * be kept in RAM. It is written right after the page is erased, which
+ * is also done when a configuration with another gamma is saved.
+ *
  * The entry count is derived in the following way:
  * Page size: 1024B
+ * Version size: 2B
+ * Gamma table size: 2B + 256 * 2B
  * Entry size with status word: sizeof(config_entry_t) + sizeof(uint16_t)
- * Entry count = Page size / Entry size
+ * Entry count = (Page size - Version size - Gamma table size) / Entry size
  */
-#define ENTRY_COUNT (FLASH_PAGE_SIZE * CONFIG_PAGES /             \
+#define GAMMA_LUT_SIZE (sizeof(uint16_t) + 256 * sizeof(uint16_t))
+#define ENTRY_COUNT ((FLASH_PAGE_SIZE * CONFIG_PAGES - sizeof(uint16_t) - GAMMA_LUT_SIZE) / \
 		     (sizeof(config_entry_t) + sizeof(uint16_t)))
+// The rest of the page, so that config_page spans all of it.
+#define PAGE_FILL_SIZE (FLASH_PAGE_SIZE * CONFIG_PAGES - sizeof(uint16_t) - GAMMA_LUT_SIZE - \
+			ENTRY_COUNT * (sizeof(config_entry_t) + sizeof(uint16_t)))
 typedef struct {
+	uint16_t version;
+
 	uint16_t entry_status[ENTRY_COUNT];
 
 	config_entry_t entries[ENTRY_COUNT];
-} __attribute__ ((packed)) config_page_t;
+
+	uint16_t gamma_lut_gamma;
+	uint16_t gamma_lut[256];
+
+	uint8_t page_fill[PAGE_FILL_SIZE];
+} __attribute__ ((packed, aligned (2))) config_page_t;
+
+_Static_assert(ENTRY_COUNT >= 1, "config_entry_t does not fit the config page");
+_Static_assert(PAGE_FILL_SIZE > 0, "config_page_t must be repadded!");
+
+/*
+ * The layout of config_entry_t and the config page before the page
+ * had a version, i.e. before flags, gamma and groups were added. The
+ * page starts with the status words, so its first halfword is never
+ * CONFIG_VERSION.
+ */
+typedef struct {
+	uint16_t my_address;
+	uint16_t heat_limit[HEAT_SENSOR_LEN];
+	led_info_t led_infos[RGB_LED_COUNT];
+	uint8_t backup_channel;
+} __attribute__ ((packed)) legacy_entry_t;
+
+#define LEGACY_ENTRY_COUNT (FLASH_PAGE_SIZE * CONFIG_PAGES /             \
+			    (sizeof(legacy_entry_t) + sizeof(uint16_t)))
+typedef struct {
+	uint16_t entry_status[LEGACY_ENTRY_COUNT];
+
+	legacy_entry_t entries[LEGACY_ENTRY_COUNT];
+} __attribute__ ((packed, aligned (2))) legacy_page_t;
+
+_Static_assert(sizeof(legacy_page_t) <= sizeof(config_page_t),
+	       "legacy_page_t does not fit the config page");
 
 config_page_t config_page __attribute__ ((section (".config"))) = {
+	.version = 0xffff,
 	.entry_status = REPEAT(0xffff, ENTRY_COUNT),
 	.entries = {
 		[0 ... ENTRY_COUNT - 1] = {
@@ -142,18 +192,81 @@ config_page_t config_page __attribute__ ((section (".config"))) = {
 					.channels = REPEAT(0xff, 3)
 				}
 			},
-			.backup_channel = 0xff
+			.backup_channel = 0xff,
+			.flags = 0xffff,
+			.gamma = 0xffff,
+			.groups = REPEAT(GROUP_NONE, GROUP_COUNT)
 		}
-	}
+	},
+	.gamma_lut_gamma = 0xffff,
+	.gamma_lut = REPEAT(0xffff, 256),
+	.page_fill = REPEAT(0xff, PAGE_FILL_SIZE)
 };
 
+/*
+ * Loads the configuration from a config page without version (see
+ * legacy_page_t). The fields it does not have get their defaults, and
+ * the configuration is saved in the current layout if it is valid.
+ *
+ * Returns an error/success code.
+ */
+static error_t load_legacy_config() {
+	const legacy_page_t *page = (const legacy_page_t*) &config_page;
+
+	unsigned in_use = LEGACY_ENTRY_COUNT;
+	for (unsigned int entry = 0; entry < LEGACY_ENTRY_COUNT; entry++) {
+		if (page->entry_status[entry] == CONFIG_ENTRY_IN_USE) {
+			in_use = entry;
+			break;
+		}
+	}
+
+	if (in_use == LEGACY_ENTRY_COUNT) {
+		return E_NOCONFIG;
+	}
+
+	const legacy_entry_t *entry = &page->entries[in_use];
+
+	config.my_address = entry->my_address;
+	for (int i = 0; i < HEAT_SENSOR_LEN; i++) {
+		config.heat_limit[i] = entry->heat_limit[i];
+	}
+	for (int l = 0; l < RGB_LED_COUNT; l++) {
+		config.led_infos[l] = entry->led_infos[l];
+	}
+	config.backup_channel = entry->backup_channel;
+	config.flags = 0;
+	config.gamma = 0;
+	for (int g = 0; g < GROUP_COUNT; g++) {
+		config.groups[g] = GROUP_NONE;
+	}
+
+	// A failed save only means that this is done again on the
+	// next start.
+	if (config_valid()) {
+		save_config();
+	}
+
+	return E_SUCCESS;
+}
+
 /*
  * Loads the configuration stored in flash. If no configuration is found,
- * an E_NOCONFIG is returned.
+ * an E_NOCONFIG is returned. A configuration stored by a firmware
+ * without config page version is converted.
  *
  * Returns an error/success code.
  */
 error_t load_config() {
+	if (config_page.version != CONFIG_VERSION) {
+		if (config_page.version == CONFIG_ENTRY_IN_USE ||
+		    config_page.version == CONFIG_ENTRY_OLD) {
+			return load_legacy_config();
+		}
+
+		return E_NOCONFIG;
+	}
+
 	// Look for an entry currently in use.
 	unsigned in_use = ENTRY_COUNT;
 	for (unsigned int entry = 0; entry < ENTRY_COUNT; entry++) {
@@ -212,17 +325,32 @@ error_t save_config() {
 	debug_putchar((unsigned char) unused);
 #endif
 
+	uint16_t gamma = config.gamma ? config.gamma : DEFAULT_GAMMA;
+
 	flash_unlock();
 
-	// If no entries are free, erase config page and try again
-	if (unused == ENTRY_COUNT) {
+	// If no entries are free, the gamma table is for another gamma
+	// or the page has another layout, erase config page and start
+	// over with a new table.
+	if (unused == ENTRY_COUNT || config_page.gamma_lut_gamma != gamma ||
+	    config_page.version != CONFIG_VERSION) {
 #ifdef TRACE_FLASH
 		debug_string("erase");
 #endif
 		error = flash_erase_page(&config_page);
 		if (error != E_SUCCESS) goto out;
 
-		return save_config();
+		for (int v = 0; v < 256; v++) {
+			error = flash_write_check(&config_page.gamma_lut[v], color_gamma(gamma, v));
+			if (error != E_SUCCESS) goto out;
+		}
+		error = flash_write_check(&config_page.gamma_lut_gamma, gamma);
+		if (error != E_SUCCESS) goto out;
+		error = flash_write_check(&config_page.version, CONFIG_VERSION);
+		if (error != E_SUCCESS) goto out;
+
+		last_in_use = ENTRY_COUNT;
+		unused = 0;
 	}
 
 	// Save the new configuration.
@@ -238,8 +366,10 @@ error_t save_config() {
 #endif
 
 	// The configuration was written successfully. Now update the status words.
-	error = flash_write_check(config_page.entry_status + last_in_use, CONFIG_ENTRY_OLD);
-	if (error != E_SUCCESS) goto out;
+	if (last_in_use != ENTRY_COUNT) {
+		error = flash_write_check(config_page.entry_status + last_in_use, CONFIG_ENTRY_OLD);
+		if (error != E_SUCCESS) goto out;
+	}
 
 	error = flash_write_check(config_page.entry_status + unused, CONFIG_ENTRY_IN_USE);
 	if (error != E_SUCCESS) goto out;
@@ -253,6 +383,20 @@ out:
 	return error;
 }
 
+/*
+ * Returns the table for expanding 8 bit values with the given gamma
+ * (in 1/100) stored in the config page, or NULL if the table there is
+ * for another gamma.
+ */
+const uint16_t *config_gamma_lut(uint16_t gamma) {
+	if (config_page.version != CONFIG_VERSION ||
+	    config_page.gamma_lut_gamma != gamma) {
+		return NULL;
+	}
+
+	return config_page.gamma_lut;
+}
+
 /*
  * Strings used in config_valid.
  */
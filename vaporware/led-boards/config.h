@@ -20,6 +20,9 @@
 
 #define RGB_LED_COUNT ((MODULE_LENGTH)/3)
 
+// Core and timer clock in Hz (see the PLL setup in startup.c).
+#define CPU_CLOCK 24000000
+
 // Mapping from timer channels to PWM registers.
 static volatile uint32_t * const TIMER_CHANNELS[MODULE_LENGTH] = {
 	&TR(TIM2,  CCR1),
@@ -40,18 +43,26 @@ static volatile uint32_t * const TIMER_CHANNELS[MODULE_LENGTH] = {
 	&TR(TIM17, CCR1)
 };
 
-// Baud rate register for the USARTs.
-#if BUS_BAUDRATE == 115200
-// Divider 13.0 * 16 = 208.3: 115200 baud at 24MHz
-static const int USART_BAUD_VALUE = (13 << 4) | 0;
-#else
- #if BUS_BAUDRATE == 500000
-// Divider 3.0 * 16 = 48.0: 500000 baud at 24MHz
-static const int USART_BAUD_VALUE = (3 << 4) | 0;
- #else
-  #error "Only baud rates 115200 and 500000 are supported"
- #endif
+// Baud rate register for the bus USART. Its value is the divider of
+// the peripheral clock (which runs at CPU_CLOCK) in 1/16, i.e. the
+// mantissa in the upper bits and a 4 bit fraction. Since the USART
+// samples each bit 16 times, the divider must be at least 1.0, which
+// limits the bus to 1.5Mbaud at 24MHz. The receiver tolerates about
+// 3% of clock deviation, half of which is left for the sender.
+#define USART_BAUD_DIVIDER (((CPU_CLOCK) + (BUS_BAUDRATE) / 2) / (BUS_BAUDRATE))
+#define USART_BAUD_ACTUAL ((CPU_CLOCK) / (USART_BAUD_DIVIDER))
+
+#if USART_BAUD_DIVIDER < 16
+ #error "BUS_BAUDRATE is too high for CPU_CLOCK (at most CPU_CLOCK / 16)"
 #endif
+#if 1000 * USART_BAUD_ACTUAL > 1015 * (BUS_BAUDRATE) || \
+	1000 * USART_BAUD_ACTUAL < 985 * (BUS_BAUDRATE)
+ #error "BUS_BAUDRATE cannot be reached within 1.5% at CPU_CLOCK"
+#endif
+
+// 24MHz: 115200 baud with divider 13.0 (0.2% off), 500000 baud
+// with 3.0, 1Mbaud with 1.5 and 1.5Mbaud with 1.0.
+static const int USART_BAUD_VALUE = USART_BAUD_DIVIDER;
 // Divider 13.0 * 16 = 208.3: 115200 baud at 24MHz
 static const int CONSOLE_BAUD_VALUE = (13 << 4) | 0;
 
@@ -63,8 +74,15 @@ static const int USART_FAIL_TRESHOLD = 20;
 
 // Number of USART command buffers.
 #define USART_BUFFER_COUNT 4
+// Maximum number of commands waiting to be run. Strobes do not need
+// a command buffer, so this may be larger than USART_BUFFER_COUNT.
+#define USART_QUEUE_LEN (2 * USART_BUFFER_COUNT)
 // Length of a USART command buffer
 #define CMD_BUFFER_LEN 36
+// Length of the circular buffer USART2 receives into by DMA. The
+// received bytes are processed whenever half of it is full, so at
+// 500000 baud the bus ISRs may be delayed by up to 640us.
+#define USART_DMA_BUFFER_LEN 64
 
 // Start-of-command marker
 #define START_MARK 0x55
@@ -100,6 +118,27 @@ static const uint8_t HEAT_ADC_PORTS[HEAT_SENSOR_LEN] = {
 	#define PWM_RELOAD ((1 << PWM_BITS) - 1)
 #endif
 
+// Number of PWM periods per second (366 for 16 bit PWM).
+#define PWM_TICK_RATE ((CPU_CLOCK) / ((PWM_RELOAD) + 1))
+
+// Number of fractional bits of the PWM values that are shown by
+// temporal dithering. Over 1 << DITHER_BITS PWM periods, every value
+// is shown exactly (i.e. at 22Hz with 4 bits).
+#define DITHER_BITS 4
+
+// Gamma used to expand 8 bit values if none is configured, in 1/100.
+#define DEFAULT_GAMMA 220
+
+// Longest time between two strobes over which frames are
+// interpolated, in ms. After longer pauses, a new frame is shown at
+// once.
+#define INTERPOLATE_MAX_MS 250
+
+// Number of group addresses a module can listen to besides its own
+// address. Unused entries are GROUP_NONE.
+#define GROUP_COUNT 4
+#define GROUP_NONE 0xff
+
 // Sample time for the heat sensors.
 #define ADC_SAMPLE_TIME 0x7 // 239.5 cycles (50kHz)
 static const int ADC_SAMPLE_TIME_1 =
@@ -135,6 +174,32 @@ static const uint8_t EEPROM_EMPTY = 0xFF;
 // must be edited accordingly.
 #define CONFIG_PAGES 1
 
+// Location and size of the resident loader (see loader.c), which
+// checks the firmware at boot and receives updates over the bus. An
+// update never erases it. When changing, both linker scripts must be
+// edited accordingly.
+#define LOADER_START 0x08000000
+#define LOADER_SIZE (2 * 1024)
+
+// Location and size of the firmware area in flash, i.e. everything
+// between the loader and the config page. Its last chunk holds the
+// image info (see update.h). When changing, both linker scripts must
+// be edited accordingly.
+#define FIRMWARE_START (LOADER_START + LOADER_SIZE)
+#define FIRMWARE_SIZE (13 * 1024)
+
+// Bytes of firmware per chunk of a bus update.
+#define UPDATE_CHUNK_SIZE 64
+// Length of the circular buffer USART2 receives into during a bus
+// update. It must hold the chunk arriving while the last one is
+// written to flash.
+#define UPDATE_DMA_BUFFER_LEN 128
+
+// Layout version of the config page. Must be changed with the layout
+// of config_entry_t or the config page, and must never be one of the
+// entry status values below.
+#define CONFIG_VERSION 0x0001
+
 // Values of configuration entry status.
 static const uint16_t CONFIG_ENTRY_EMPTY = 0xffff; // Should be default Flash value.
 static const uint16_t CONFIG_ENTRY_IN_USE = 0x5555;
@@ -186,6 +251,20 @@ typedef struct {
 	uint8_t channels[3];
 } __attribute__ ((packed)) led_info_t;
 
+/*
+ * Option flags in config_entry_t.
+ *     CONFIG_INTERPOLATE:  Ramp from one frame to the next over the
+ *                          time between the strobes, instead of
+ *                          switching at once.
+ *     CONFIG_DITHER:       Show the fractional part of PWM values
+ *                          (see DITHER_BITS) by alternating the
+ *                          compare values over PWM periods.
+ */
+typedef enum {
+	CONFIG_INTERPOLATE = 0x0001,
+	CONFIG_DITHER = 0x0002
+} config_flag_t;
+
 /*
  * Struct for a complete set of configuration.
  */
@@ -203,6 +282,17 @@ typedef struct {
 
 	// The channel that is not used by any LED.
 	uint8_t backup_channel;
+
+	// Option flags, see config_flag_t.
+	uint16_t flags;
+
+	// Gamma for the expansion of 8 bit values, in 1/100.
+	// 0 selects DEFAULT_GAMMA.
+	uint16_t gamma;
+
+	// Further addresses this module accepts commands for, so that
+	// one frame can update a group of modules.
+	uint8_t groups[GROUP_COUNT];
 } __attribute__ ((packed)) config_entry_t;
 
 /*
@@ -212,7 +302,8 @@ extern config_entry_t config;
 
 /*
  * Loads the configuration stored in flash. If no configuration is found,
- * E_NOCONFIG is returned.
+ * E_NOCONFIG is returned. A configuration stored by a firmware without
+ * config page version is converted.
  *
  * Returns an error/success code.
  */
@@ -223,6 +314,13 @@ error_t load_config();
  */
 error_t save_config();
 
+/*
+ * Returns the table for expanding 8 bit values with the given gamma
+ * (in 1/100) stored in the config page, or NULL if the table there is
+ * for another gamma.
+ */
+const uint16_t *config_gamma_lut(uint16_t gamma);
+
 /*
  * Checks if the configuration in config is valid.  Returns 1 if the
  * configuration is valid, 0 otherwise.  This function may print an
@@ -56,6 +56,18 @@ static const char *SENSOR_OUT_OF_RANGE =
 static const char *HEAT_LIMIT_OUT_OF_RANGE =
 	"Heat limit out of range (0 to 0xffff)" CRLF;
 
+static const char *FLAGS_OUT_OF_RANGE =
+	"Unknown option flags (allowed: 0x0001, 0x0002)" CRLF;
+
+static const char *GROUP_OUT_OF_RANGE =
+	"Group index out of range (0 to " XSTR(GROUP_COUNT) "-1)" CRLF;
+
+static const char *GROUP_ADDR_OUT_OF_RANGE =
+	"Group address out of range (0x00 to 0xfe, 0xff to remove)" CRLF;
+
+static const char *GAMMA_OUT_OF_RANGE =
+	"Gamma out of range (0 or 10 to 500)" CRLF;
+
 static const char *NO_CONFIG_FOUND =
 	"No configuration in flash" CRLF;
 
@@ -188,10 +200,8 @@ static error_t run_set_color(unsigned int args[]) {
 		return E_ARG_FORMAT;
 	}
 
-	led_info_t info = config.led_infos[index];
-
 	uint16_t rgb[3];
-	color_correct(info, x, y, Y, rgb);
+	color_correct(index, x, y, Y, rgb);
 
 	console_write("Color correction: ");
 	console_uint_d(rgb[RED]); console_write(" ");
@@ -199,7 +209,7 @@ static error_t run_set_color(unsigned int args[]) {
 	console_uint_d(rgb[BLUE]); console_write(CRLF);
 
 	for(int i = 0; i < 3; i++) {
-		error_t error = pwm_set_brightness(info.channels[i], rgb[i]);
+		error_t error = pwm_set_brightness(config.led_infos[index].channels[i], rgb[i]);
 		if (error) return error;
 	}
 
@@ -256,6 +266,7 @@ static error_t run_calibrate_led(unsigned int args[]) {
 
 	fixed_t *out = config.led_infos[index].color_matrix;
 	invert_3x3(matrix, out);
+	color_prepare();
 
 	return E_SUCCESS;
 }
@@ -333,6 +344,7 @@ static error_t run_reload_config(unsigned int args[]) {
 	console_write(RELOADING_CONFIG);
 
 	error_t error = load_config();
+	color_prepare();
 
 	switch (error) {
 	case E_SUCCESS:
@@ -368,6 +380,7 @@ static error_t run_set_correction(unsigned int args[]) {
 		int input = console_ask_int("", 10);
 		config.led_infos[led].color_matrix[i] = (fixed_t){ input };
 	}
+	color_prepare();
 
 	return E_SUCCESS;
 }
@@ -403,6 +416,69 @@ static error_t run_set_pwm_channels(unsigned int args[]) {
 	return E_SUCCESS;
 }
 
+/*
+ * Runs the "set option flags" command.
+ *
+ * Expected format for args: { flags }
+ *
+ * Returns E_ARG_FORMAT if unknown flags are given.
+ */
+static error_t run_set_flags(unsigned int args[]) {
+	unsigned int flags = args[0];
+
+	if (flags & ~(CONFIG_INTERPOLATE | CONFIG_DITHER)) {
+		console_write(FLAGS_OUT_OF_RANGE);
+		return E_ARG_FORMAT;
+	}
+
+	config.flags = flags;
+	return E_SUCCESS;
+}
+
+/*
+ * Runs the "set group address" command.
+ *
+ * Expected format for args: { group-index, address }
+ *
+ * Returns E_ARG_FORMAT if the index or the address is out of range.
+ */
+static error_t run_set_group(unsigned int args[]) {
+	int group = args[0];
+	unsigned int addr = args[1];
+
+	if (check_range(group, GROUP_COUNT, GROUP_OUT_OF_RANGE)) {
+		return E_ARG_FORMAT;
+	}
+	if (addr > 0xff) {
+		console_write(GROUP_ADDR_OUT_OF_RANGE);
+		return E_ARG_FORMAT;
+	}
+
+	config.groups[group] = addr;
+	return E_SUCCESS;
+}
+
+/*
+ * Runs the "set gamma" command.
+ *
+ * Expected format for args: { gamma }
+ *
+ * Returns E_ARG_FORMAT if the gamma is out of range.
+ */
+static error_t run_set_gamma(unsigned int args[]) {
+	unsigned int gamma = args[0];
+
+	if (gamma != 0 && (gamma < 10 || gamma > 500)) {
+		console_write(GAMMA_OUT_OF_RANGE);
+		return E_ARG_FORMAT;
+	}
+
+	config.gamma = gamma;
+	color_prepare();
+
+	return E_SUCCESS;
+}
+
 /*
  * Runs the "quit" command.
  *
@@ -478,6 +554,7 @@ static error_t run_set_max_Y(unsigned int args[]) {
 		int input = console_ask_int("", 16);
 		config.led_infos[led].peak_Y[i] = (fixed_t){ input };
 	}
+	color_prepare();
 
 	return E_SUCCESS;
 }
@@ -532,6 +609,20 @@ static console_command_t commands[] = {
 		.usage = "f: Paste a command file",
 		.does_exit = 0,
 	},
+	{
+		.key = 'g',
+		.arg_length = 2,
+		.handler = run_set_group,
+		.usage = "g <index> <address>: Set a group address (255 to remove)",
+		.does_exit = 0,
+	},
+	{
+		.key = 'G',
+		.arg_length = 1,
+		.handler = run_set_gamma,
+		.usage = "G <gamma>: Set gamma for 8 bit values (in 1/100, 0 for " XSTR(DEFAULT_GAMMA) ")",
+		.does_exit = 0,
+	},
 	{
 		.key = 'h',
 		.arg_length = 2,
@@ -553,6 +644,13 @@ static console_command_t commands[] = {
 		.usage = "m <led>: set an LED's correction matrix",
 		.does_exit = 0,
 	},
+	{
+		.key = 'o',
+		.arg_length = 1,
+		.handler = run_set_flags,
+		.usage = "o <flags>: Set option flags (1: interpolate between frames, 2: dither)",
+		.does_exit = 0,
+	},
 	{
 		.key = 'p',
 		.arg_length = 4,
@@ -627,6 +725,15 @@ static const char *MODULE_ADDRESS =
 static const char *IS_BROADCAST =
 	" (broadcast)";
 
+static const char *OPTION_FLAGS =
+	"Option flags: ";
+
+static const char *GAMMA =
+	"Gamma (1/100): ";
+
+static const char *GROUPS =
+	"Groups: ";
+
 static const char *HEAT_SETTINGS_HEAD =
 	"Heat sensor settings:" CRLF
         "Sensor  Limit" CRLF;
@@ -648,6 +755,15 @@ void show_status_prompt() {
 /*
 vaporlight build 0000000000000000000000000000000000000000
 This is module 99
+Option flags: 0000
+Gamma (1/100): 220
+Groups: 99 99 -- --
+
+Statistics since reset:
+Frames accepted: 99  filtered: 99
+Bad escapes: 99  overflows: 99  USART errors: 99
+Strobes: 99  commands: 99  cycles max: 9999  avg: 9999
+Debug output dropped: 99
 
 Heat sensor settings:
 Sensor   Limit
@@ -686,6 +802,25 @@ LED  channel  correction matrix           Y_max
 	if (config.my_address == 0xfd) {
 		console_write(IS_BROADCAST);
 	}
+	console_write(CRLF);
+
+	console_write(OPTION_FLAGS);
+	console_uint_04x(config.flags);
+	console_write(CRLF);
+
+	console_write(GAMMA);
+	console_uint_d(config.gamma ? config.gamma : DEFAULT_GAMMA);
+	console_write(CRLF);
+
+	console_write(GROUPS);
+	for (int g = 0; g < GROUP_COUNT; g++) {
+		if (config.groups[g] == GROUP_NONE) {
+			console_write("--");
+		} else {
+			console_uint_d(config.groups[g]);
+		}
+		console_putchar(' ');
+	}
 	console_write(CRLF CRLF);
 
 	console_write(HEAT_SETTINGS_HEAD);
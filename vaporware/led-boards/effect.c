@@ -0,0 +1,282 @@
+#include "effect.h"
+
+#include <stdbool.h>
+
+#include "config.h"
+#include "fade.h"
+#include "fixedpoint.h"
+#include "pwm.h"
+
+/*
+ * An effect with its parameters.
+ */
+typedef struct {
+	effect_type_t type;
+	// Phase advance per PWM period; a full cycle is 2^32.
+	uint32_t step;
+	// Phase offset of this module.
+	uint32_t offset;
+	uint16_t level;
+} effect_t;
+
+// The effect waiting for the next strobe.
+static effect_t pending;
+static bool have_pending = false;
+
+// The effect in progress.
+static effect_t running;
+static bool is_running = false;
+
+// The position in the cycle of the running effect (see effect_t.step).
+static uint32_t phase;
+
+// The frame shown when the effect was started (indexed by PWM channel).
+static uint16_t palette[MODULE_LENGTH];
+
+// The brightness of each RGB LED during a twinkle.
+static fixed_t sparkle[RGB_LED_COUNT];
+
+// State of the twinkle random number generator, never 0.
+static uint32_t random_state;
+
+static const fixed_t ONE = FIXINIT(1.0);
+
+/*
+ * Returns the next pseudo-random number (xorshift).
+ */
+static uint32_t next_random() {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+
+	return random_state;
+}
+
+/*
+ * Scales value by f (between 0 and 1) and returns the result with
+ * DITHER_BITS fractional bits, as expected by pwm_send_fine.
+ */
+static uint32_t scale(uint16_t value, fixed_t f) {
+	return ((uint32_t) value * (uint32_t) f.v) >> (FRAC_BITS - DITHER_BITS);
+}
+
+/*
+ * Sets the RGB channels of every LED to a colour of full saturation
+ * whose hue goes once around the colour wheel along the module.
+ */
+static void rainbow(uint32_t values[static MODULE_LENGTH]) {
+	fixed_t level = fixfract(running.level);
+
+	for (int l = 0; l < RGB_LED_COUNT; l++) {
+		uint16_t hue = (phase >> 16) + l * (65536 / RGB_LED_COUNT);
+
+		// The colour wheel has six sectors, in each of which one
+		// of the components rises or falls linearly.
+		uint32_t position = (uint32_t) hue * 6;
+		fixed_t rising = fixfract(position & 0xffff);
+		fixed_t falling = fixsub(ONE, rising);
+		fixed_t zero = FIXNUM(0.0);
+		fixed_t rgb[3];
+
+		switch (position >> 16) {
+		case 0:  rgb[0] = ONE;     rgb[1] = rising;  rgb[2] = zero;    break;
+		case 1:  rgb[0] = falling; rgb[1] = ONE;     rgb[2] = zero;    break;
+		case 2:  rgb[0] = zero;    rgb[1] = ONE;     rgb[2] = rising;  break;
+		case 3:  rgb[0] = zero;    rgb[1] = falling; rgb[2] = ONE;     break;
+		case 4:  rgb[0] = rising;  rgb[1] = zero;    rgb[2] = ONE;     break;
+		default: rgb[0] = ONE;     rgb[1] = zero;    rgb[2] = falling; break;
+		}
+
+		for (int c = 0; c < 3; c++) {
+			values[config.led_infos[l].channels[c]] =
+				scale(0xffff, fixmul(rgb[c], level));
+		}
+	}
+}
+
+/*
+ * Scales the palette between level and full brightness, following a
+ * smoothstep up and down once per cycle.
+ */
+static void breathe(uint32_t values[static MODULE_LENGTH]) {
+	fixed_t t = fixfract(phase >> 16);
+
+	// Triangle wave from 0 up to 1 and back to 0.
+	if (fixge(t, FIXNUM(0.5))) {
+		t = fixsub(ONE, t);
+	}
+	t = fixmul(fixnum(2), t);
+
+	// 3t^2 - 2t^3
+	fixed_t s = fixmul(fixmul(t, t), fixsub(fixnum(3), fixmul(fixnum(2), t)));
+
+	fixed_t level = fixfract(running.level);
+	fixed_t f = fixadd(level, fixmul(fixsub(ONE, level), s));
+
+	for (int c = 0; c < MODULE_LENGTH; c++) {
+		values[c] = scale(palette[c], f);
+	}
+}
+
+/*
+ * Lets each RGB LED flash up in its palette colour with a chance of
+ * level/65536 per PWM period. A flash fades out linearly over one
+ * cycle. The backup channel keeps its palette value.
+ */
+static void twinkle(uint32_t values[static MODULE_LENGTH]) {
+	fixed_t decay = fixfract(running.step >> 16);
+	if (fixeq(decay, FIXNUM(0.0))) {
+		decay = fixfract(1);
+	}
+
+	for (int l = 0; l < RGB_LED_COUNT; l++) {
+		sparkle[l] = fixmax(fixsub(sparkle[l], decay), FIXNUM(0.0));
+
+		if ((next_random() >> 16) < running.level) {
+			sparkle[l] = ONE;
+		}
+
+		for (int c = 0; c < 3; c++) {
+			uint8_t channel = config.led_infos[l].channels[c];
+			values[channel] = scale(palette[channel], sparkle[l]);
+		}
+	}
+}
+
+/*
+ * Computes the values of the running effect at the current phase and
+ * sends them to the PWM hardware.
+ */
+static void step() {
+	// Channels not used by the effect show the palette.
+	uint32_t values[MODULE_LENGTH];
+	for (int c = 0; c < MODULE_LENGTH; c++) {
+		values[c] = palette[c] << DITHER_BITS;
+	}
+
+	switch (running.type) {
+	case EFFECT_RAINBOW:
+		rainbow(values);
+		break;
+	case EFFECT_BREATHE:
+		breathe(values);
+		break;
+	case EFFECT_TWINKLE:
+		twinkle(values);
+		break;
+	case EFFECT_NONE:
+	default:
+		break;
+	}
+
+	pwm_send_fine(values);
+}
+
+/*
+ * Starts the pending effect with the frame set with pwm_set_brightness
+ * as palette.
+ */
+static void start() {
+	running = pending;
+	phase = running.offset;
+
+	for (int c = 0; c < MODULE_LENGTH; c++) {
+		palette[c] = pwm_get_brightness(c);
+	}
+	for (int l = 0; l < RGB_LED_COUNT; l++) {
+		sparkle[l] = FIXNUM(0.0);
+	}
+	random_state = config.my_address + 1;
+	is_running = true;
+
+	// Replace the frame sent by the strobe right away.
+	step();
+}
+
+/*
+ * Prepares an effect, which starts with the next strobe. period_ms
+ * is the length of one cycle of the effect. The phase of each module
+ * is shifted by phase_step/65536 of a cycle per address, so that the
+ * effect runs along the modules. The meaning of level depends on the
+ * effect, see HACKING.
+ *
+ * Returns an error/success code.
+ */
+error_t effect_prepare(uint8_t type, uint16_t period_ms,
+		       uint16_t phase_step, uint16_t level) {
+	if (type > EFFECT_TWINKLE) {
+		return E_WRONGCOMMAND;
+	}
+
+	uint32_t ticks = ((uint32_t) period_ms * PWM_TICK_RATE + 500) / 1000;
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	pending.type = type;
+	pending.step = UINT32_MAX / ticks;
+	pending.offset = ((uint32_t) phase_step * config.my_address) << 16;
+	pending.level = level;
+	have_pending = true;
+
+	return E_SUCCESS;
+}
+
+/*
+ * Handles a strobe. If an effect has been prepared, the frame is
+ * strobed with fade_strobe and then becomes the palette of the
+ * effect. While an effect is running, other strobes are ignored.
+ * Otherwise, this is the same as fade_strobe.
+ *
+ * Returns an error/success code.
+ */
+error_t effect_strobe() {
+	if (have_pending) {
+		have_pending = false;
+		error_t error = fade_strobe();
+
+		if (pending.type == EFFECT_NONE) {
+			is_running = false;
+		} else {
+			start();
+		}
+
+		return error;
+	}
+
+	if (is_running) {
+		return E_SUCCESS;
+	}
+
+	return fade_strobe();
+}
+
+/*
+ * Stops a running effect where it is, i.e. the values shown become the
+ * values set with pwm_set_brightness. A prepared effect is not
+ * cancelled.
+ */
+void effect_stop() {
+	if (!is_running) {
+		return;
+	}
+
+	for (int c = 0; c < MODULE_LENGTH; c++) {
+		pwm_set_brightness(c, pwm_get_output(c));
+	}
+	is_running = false;
+}
+
+/*
+ * Advances the running effect by one PWM period and sends the new
+ * values to the PWM hardware. Must be called once per PWM period,
+ * after fade_tick.
+ */
+void effect_tick() {
+	if (!is_running) {
+		return;
+	}
+
+	phase += running.step;
+	step();
+}
@@ -0,0 +1,60 @@
+#ifndef EFFECT_H
+#define EFFECT_H
+
+#include <stdint.h>
+
+#include "error.h"
+
+/*
+ * The effects a module can run on its own.
+ *     EFFECT_NONE:     Stops the running effect.
+ *     EFFECT_RAINBOW:  Cycles the hue of all RGB LEDs.
+ *     EFFECT_BREATHE:  Pulses the current frame between a minimum
+ *                      level and full brightness.
+ *     EFFECT_TWINKLE:  Flashes random LEDs in the colours of the
+ *                      current frame.
+ */
+typedef enum {
+	EFFECT_NONE = 0x00,
+	EFFECT_RAINBOW = 0x01,
+	EFFECT_BREATHE = 0x02,
+	EFFECT_TWINKLE = 0x03
+} effect_type_t;
+
+/*
+ * Prepares an effect, which starts with the next strobe. period_ms
+ * is the length of one cycle of the effect. The phase of each module
+ * is shifted by phase_step/65536 of a cycle per address, so that the
+ * effect runs along the modules. The meaning of level depends on the
+ * effect, see HACKING.
+ *
+ * Returns an error/success code.
+ */
+error_t effect_prepare(uint8_t type, uint16_t period_ms,
+		       uint16_t phase_step, uint16_t level);
+
+/*
+ * Handles a strobe. If an effect has been prepared, the frame is
+ * strobed with fade_strobe and then becomes the palette of the
+ * effect. While an effect is running, other strobes are ignored.
+ * Otherwise, this is the same as fade_strobe.
+ *
+ * Returns an error/success code.
+ */
+error_t effect_strobe();
+
+/*
+ * Stops a running effect where it is, i.e. the values shown become the
+ * values set with pwm_set_brightness. A prepared effect is not
+ * cancelled.
+ */
+void effect_stop();
+
+/*
+ * Advances the running effect by one PWM period and sends the new
+ * values to the PWM hardware. Must be called once per PWM period,
+ * after fade_tick.
+ */
+void effect_tick();
+
+#endif
@@ -4,6 +4,7 @@
 #include "console.h"
 #include "debug.h"
 #include "pwm.h"
+#include "usart1.h"
 
 #include "stm_include/stm32/gpio.h"
 #include "stm_include/stm32/scb.h"
@@ -80,6 +81,8 @@ void error(err_reason_t reason, char *message, int length, err_action_t action)
 		break;
 	case EA_RESET:
 		pwm_set_state(PWM_STOP);
+		// The message must not be dropped.
+		usart1_set_blocking(1);
 
 		dled_blink((int) reason);
 		console_write_raw(message, length);
@@ -89,6 +92,7 @@ void error(err_reason_t reason, char *message, int length, err_action_t action)
 		break;
 	case EA_PANIC:
 		pwm_set_state(PWM_STOP);
+		usart1_set_blocking(1);
 
 		while (1) {
 			dled_blink((int) reason);
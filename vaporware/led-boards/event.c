@@ -0,0 +1,104 @@
+#include "event.h"
+
+#include "config.h"
+#include "debug.h"
+#include "sync.h"
+
+/*
+ * The set of pending events.
+ */
+static volatile uint32_t pending = 0;
+
+#ifdef TRACE_LATENCY
+/*
+ * The cycle count when each pending event was posted, and the
+ * longest time from posting an event to taking it since the last
+ * report.
+ */
+static uint32_t posted_at[EVENT_COUNT];
+static uint32_t max_latency[EVENT_COUNT];
+static int periods = 0;
+
+/*
+ * Records the latency of the taken events and reports the maximum
+ * about once per second. Must be called with interrupts off.
+ */
+static void trace_latency(uint32_t events) {
+	uint32_t now = cycle_get();
+
+	for (int e = 0; e < EVENT_COUNT; e++) {
+		if (events & EVENT_BIT(e)) {
+			uint32_t latency = now - posted_at[e];
+			if (latency > max_latency[e]) {
+				max_latency[e] = latency;
+			}
+		}
+	}
+
+	if ((events & EVENT_BIT(EVENT_PERIOD)) && ++periods == PWM_TICK_RATE) {
+		debug_string("LAT");
+		debug_write((char*) max_latency, sizeof(max_latency));
+		for (int e = 0; e < EVENT_COUNT; e++) {
+			max_latency[e] = 0;
+		}
+		periods = 0;
+	}
+}
+#endif
+
+/*
+ * Marks the given event as pending.
+ */
+void event_post(event_t event) {
+	// This must not switch interrupts on, since it is called from
+	// ISRs.
+	uint32_t before = __sync_fetch_and_or(&pending, EVENT_BIT(event));
+
+#ifdef TRACE_LATENCY
+	if (!(before & EVENT_BIT(event))) {
+		posted_at[event] = cycle_get();
+	}
+#else
+	(void) before;
+#endif
+}
+
+/*
+ * Returns true if the given event is pending.
+ */
+bool event_is_pending(event_t event) {
+	return pending & EVENT_BIT(event);
+}
+
+/*
+ * Returns the set of pending events and clears it.
+ */
+uint32_t event_take() {
+	interrupts_off();
+	uint32_t events = pending;
+	pending = 0;
+#ifdef TRACE_LATENCY
+	trace_latency(events);
+#endif
+	interrupts_on();
+
+	return events;
+}
+
+/*
+ * Sleeps until an event is pending, then returns the set of pending
+ * events and clears it.
+ */
+uint32_t event_wait() {
+	// An interrupt between checking and sleeping would be missed
+	// with interrupts enabled. WFI wakes up on a pending
+	// interrupt even while they are disabled, and it is served as
+	// soon as they are enabled again.
+	interrupts_off();
+	if (pending == 0) {
+		__asm("wfi");
+	}
+	interrupts_on();
+
+	return event_take();
+}
@@ -0,0 +1,49 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The events the ISRs post to the main loop.
+ *     EVENT_COMMAND:  A bus command is waiting in the USART2 queue.
+ *     EVENT_PERIOD:   A PWM period has started.
+ *     EVENT_HEAT:     A heat check is due.
+ *     EVENT_CONSOLE:  Input has arrived on USART1.
+ */
+typedef enum {
+	EVENT_COMMAND,
+	EVENT_PERIOD,
+	EVENT_HEAT,
+	EVENT_CONSOLE,
+	EVENT_COUNT
+} event_t;
+
+/*
+ * The bit of an event in the set returned by event_take.
+ */
+#define EVENT_BIT(event) (1 << (event))
+
+/*
+ * Marks the given event as pending. Posting an event which is already
+ * pending has no further effect. May be called from ISRs.
+ */
+void event_post(event_t event);
+
+/*
+ * Returns true if the given event is pending.
+ */
+bool event_is_pending(event_t event);
+
+/*
+ * Returns the set of pending events and clears it.
+ */
+uint32_t event_take();
+
+/*
+ * Sleeps until an event is pending, then returns the set of pending
+ * events and clears it.
+ */
+uint32_t event_wait();
+
+#endif
@@ -0,0 +1,196 @@
+#include "fade.h"
+
+#include <stdbool.h>
+
+#include "pwm.h"
+
+/*
+ * A fade of all PWM channels.
+ */
+typedef struct {
+	uint16_t from[MODULE_LENGTH];
+	uint16_t to[MODULE_LENGTH];
+	// Length of the fade in PWM periods.
+	uint32_t ticks;
+	// Number of PWM periods since the fade was started.
+	uint32_t elapsed;
+	fade_curve_t curve;
+} fade_t;
+
+// The fade waiting for the next strobe.
+static fade_t pending;
+static bool have_pending = false;
+
+// The fade in progress.
+static fade_t running;
+static bool is_running = false;
+// Set if the running fade interpolates between two frames.
+static bool is_interpolating = false;
+
+// Number of PWM periods since the last strobe.
+static uint32_t strobe_ticks = 0;
+
+/*
+ * Maps the progress t of a fade (in 1/65536) to the fraction (in
+ * 1/65536) of the way from the start to the target value according
+ * to the curve.
+ */
+static uint32_t apply_curve(fade_curve_t curve, uint32_t t) {
+	uint32_t t2 = (t * t) >> 16;
+
+	switch (curve) {
+	case FADE_SMOOTHSTEP:
+		// 3t^2 - 2t^3
+		return ((uint64_t) t2 * (3 * 65536 - 2 * t)) >> 16;
+	case FADE_EASE_IN:
+		return t2;
+	case FADE_EASE_OUT:
+		// 1 - (1 - t)^2
+		return 2 * t - t2;
+	case FADE_LINEAR:
+	default:
+		return t;
+	}
+}
+
+/*
+ * Advances the running fade by one PWM period and sends the new
+ * values to the PWM hardware.
+ */
+static void step() {
+	if (!is_running) {
+		return;
+	}
+
+	// The values are computed with DITHER_BITS fractional bits, so
+	// that slow fades do not show steps.
+	uint32_t values[MODULE_LENGTH];
+
+	if (running.elapsed >= running.ticks) {
+		for (int c = 0; c < MODULE_LENGTH; c++) {
+			values[c] = running.to[c] << DITHER_BITS;
+		}
+		is_running = false;
+	} else {
+		uint32_t t = (running.elapsed << 16) / running.ticks;
+		int32_t f = apply_curve(running.curve, t);
+
+		for (int c = 0; c < MODULE_LENGTH; c++) {
+			int32_t diff = running.to[c] - running.from[c];
+			values[c] = (running.from[c] << DITHER_BITS) +
+				(int32_t) (((int64_t) diff * f) >> (16 - DITHER_BITS));
+		}
+		running.elapsed++;
+	}
+
+	pwm_send_fine(values);
+}
+
+/*
+ * Starts the given fade from the values currently shown. The targets
+ * become the values set with pwm_set_brightness, so that later set
+ * commands change the frame the fade ends in.
+ */
+static void start(const fade_t *fade) {
+	running = *fade;
+
+	for (int c = 0; c < MODULE_LENGTH; c++) {
+		running.from[c] = pwm_get_output(c);
+		pwm_set_brightness(c, running.to[c]);
+	}
+	is_running = true;
+
+	// A fade shorter than a PWM period just sets the targets.
+	step();
+}
+
+/*
+ * Prepares a fade of all PWM channels from their current values to
+ * the values in targets (indexed by PWM channel) over duration_ms
+ * milliseconds. The fade starts with the next strobe.
+ *
+ * Returns an error/success code.
+ */
+error_t fade_prepare(uint16_t duration_ms, uint8_t curve,
+		     uint16_t targets[static MODULE_LENGTH]) {
+	if (curve > FADE_EASE_OUT) {
+		return E_WRONGCOMMAND;
+	}
+
+	for (int c = 0; c < MODULE_LENGTH; c++) {
+		pending.to[c] = targets[c];
+	}
+	pending.ticks = ((uint32_t) duration_ms * PWM_TICK_RATE + 500) / 1000;
+	pending.elapsed = 0;
+	pending.curve = curve;
+	have_pending = true;
+
+	return E_SUCCESS;
+}
+
+/*
+ * Shows the values set since the last strobe. If a fade has been
+ * prepared, it is started instead. If CONFIG_INTERPOLATE is set, the
+ * values are approached linearly over the time since the last strobe.
+ * Otherwise, they are shown at once.
+ *
+ * Returns an error/success code.
+ */
+error_t fade_strobe() {
+	uint32_t interval = strobe_ticks;
+	strobe_ticks = 0;
+
+	if (have_pending) {
+		have_pending = false;
+		is_interpolating = false;
+		start(&pending);
+	} else if ((config.flags & CONFIG_INTERPOLATE) &&
+		   interval <= INTERPOLATE_MAX_MS * PWM_TICK_RATE / 1000) {
+		fade_t ramp = {
+			.ticks = interval,
+			.elapsed = 0,
+			.curve = FADE_LINEAR
+		};
+		for (int c = 0; c < MODULE_LENGTH; c++) {
+			ramp.to[c] = pwm_get_brightness(c);
+		}
+		is_interpolating = true;
+		start(&ramp);
+	} else {
+		is_running = false;
+		return pwm_send_frame();
+	}
+
+	return E_SUCCESS;
+}
+
+/*
+ * Stops a running fade where it is, i.e. the values shown become the
+ * values set with pwm_set_brightness. A fade waiting for the next
+ * strobe is dropped, so that it does not replace values set after
+ * it. Does not stop the interpolation between frames.
+ */
+void fade_stop() {
+	have_pending = false;
+
+	if (!is_running || is_interpolating) {
+		return;
+	}
+
+	for (int c = 0; c < MODULE_LENGTH; c++) {
+		pwm_set_brightness(c, pwm_get_output(c));
+	}
+	is_running = false;
+}
+
+/*
+ * Advances the running fade by one PWM period and sends the new
+ * values to the PWM hardware. Must be called once per PWM period.
+ */
+void fade_tick() {
+	if (strobe_ticks < UINT32_MAX) {
+		strobe_ticks++;
+	}
+
+	step();
+}
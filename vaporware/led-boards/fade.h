@@ -0,0 +1,57 @@
+#ifndef FADE_H
+#define FADE_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "error.h"
+
+/*
+ * The curves a fade can follow.
+ *     FADE_LINEAR:      Constant speed.
+ *     FADE_SMOOTHSTEP:  Slow at start and end.
+ *     FADE_EASE_IN:     Slow at start (quadratic).
+ *     FADE_EASE_OUT:    Slow at end (quadratic).
+ */
+typedef enum {
+	FADE_LINEAR = 0x00,
+	FADE_SMOOTHSTEP = 0x01,
+	FADE_EASE_IN = 0x02,
+	FADE_EASE_OUT = 0x03
+} fade_curve_t;
+
+/*
+ * Prepares a fade of all PWM channels from their current values to
+ * the values in targets (indexed by PWM channel) over duration_ms
+ * milliseconds. The fade starts with the next strobe.
+ *
+ * Returns an error/success code.
+ */
+error_t fade_prepare(uint16_t duration_ms, uint8_t curve,
+		     uint16_t targets[static MODULE_LENGTH]);
+
+/*
+ * Shows the values set since the last strobe. If a fade has been
+ * prepared, it is started instead. If CONFIG_INTERPOLATE is set, the
+ * values are approached linearly over the time since the last strobe.
+ * Otherwise, they are shown at once.
+ *
+ * Returns an error/success code.
+ */
+error_t fade_strobe();
+
+/*
+ * Stops a running fade where it is, i.e. the values shown become the
+ * values set with pwm_set_brightness. A fade waiting for the next
+ * strobe is dropped, so that it does not replace values set after
+ * it. Does not stop the interpolation between frames.
+ */
+void fade_stop();
+
+/*
+ * Advances the running fade by one PWM period and sends the new
+ * values to the PWM hardware. Must be called once per PWM period.
+ */
+void fade_tick();
+
+#endif
@@ -1,10 +1,16 @@
 #ifndef FIXEDPOINT_H
 #define FIXEDPOINT_H
 
-#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+/*
+ * Fixed point numbers with 16 integral and 16 fractional bits.
+ *
+ * All functions are static inline, so that each use compiles to a few
+ * instructions without depending on -flto.
+ */
+
 /*
  * val is packed in a struct to prevent inadvertant usage of + - * /.
  */
@@ -25,58 +31,190 @@ typedef struct {
 #define FIXINIT(f) {((((int)(f)) << 16) + (int)((f - (int)(f)) * (1 << FRAC_BITS)))}
 #define FIXNUM(f) ((fixed_t) FIXINIT(f))
 
+/*
+ * The largest and smallest fixed point numbers. fixdiv and fixinv
+ * return these instead of overflowing.
+ */
+#define FIX_MAX ((fixed_t) { INT32_MAX })
+#define FIX_MIN ((fixed_t) { INT32_MIN })
+
 /*
  * Returns a fixed point number with the value n.
  */
-fixed_t fixnum(int16_t n);
+static inline fixed_t fixnum(int16_t n) {
+	return (fixed_t) { n * (1 << FRAC_BITS) };
+}
 
 /*
  * Returns a fixed point number with the value n/65536.
  */
-fixed_t fixfract(uint16_t n);
+static inline fixed_t fixfract(uint16_t n) {
+	return (fixed_t) { n };
+}
 
 /*
  * Returns the integral part of f.
  */
-int16_t fix_int_part(fixed_t f);
+static inline int16_t fix_int_part(fixed_t f) {
+	return (int16_t) (f.v >> FRAC_BITS);
+}
 
 /*
  * Returns the fractional part of f.
  */
-uint16_t fix_fract_part(fixed_t f);
+static inline uint16_t fix_fract_part(fixed_t f) {
+	return (uint16_t) f.v;
+}
+
+/*
+ * Returns v as a fixed point number, or FIX_MAX or FIX_MIN if it is
+ * out of range.
+ */
+static inline fixed_t fix_saturate(int64_t v) {
+	if (v > INT32_MAX) {
+		return FIX_MAX;
+	} else if (v < INT32_MIN) {
+		return FIX_MIN;
+	} else {
+		return (fixed_t) { (int32_t) v };
+	}
+}
 
 /*
- * Basic arithmetic operations on fixed point numbers.
+ * Basic arithmetic operations on fixed point numbers. They wrap
+ * around on overflow.
  */
-fixed_t fixadd(fixed_t f, fixed_t g);
-fixed_t fixsub(fixed_t f, fixed_t g);
-fixed_t fixmul(fixed_t f, fixed_t g);
-fixed_t fixdiv(fixed_t f, fixed_t g);
+static inline fixed_t fixadd(fixed_t f, fixed_t g) {
+	return (fixed_t) { f.v + g.v };
+}
+
+static inline fixed_t fixsub(fixed_t f, fixed_t g) {
+	return (fixed_t) { f.v - g.v };
+}
+
+static inline fixed_t fixmul(fixed_t f, fixed_t g) {
+	return (fixed_t) { (int32_t) (((int64_t) f.v * g.v) >> FRAC_BITS) };
+}
+
+/*
+ * Divides f by g. Division by zero gives FIX_MAX or FIX_MIN (by the
+ * sign of f), as does a quotient out of range.
+ */
+static inline fixed_t fixdiv(fixed_t f, fixed_t g) {
+	if (g.v == 0) {
+		return f.v < 0 ? FIX_MIN : FIX_MAX;
+	}
+	return fix_saturate(((int64_t) f.v * (1 << FRAC_BITS)) / g.v);
+}
 
 /*
  * Unary negation
  */
-fixed_t fixneg(fixed_t f);
+static inline fixed_t fixneg(fixed_t f) {
+	return (fixed_t) { -f.v };
+}
 
 /*
  * Convenience functions for longer sums and products.
  */
-fixed_t fixadd3(fixed_t f, fixed_t g, fixed_t h);
+static inline fixed_t fixadd3(fixed_t f, fixed_t g, fixed_t h) {
+	return (fixed_t) { f.v + g.v + h.v };
+}
 
 /*
  * Relational operators.
  */
-bool fixlt(fixed_t f, fixed_t g);
-bool fixgt(fixed_t f, fixed_t g);
-bool fixle(fixed_t f, fixed_t g);
-bool fixge(fixed_t f, fixed_t g);
-bool fixeq(fixed_t f, fixed_t g);
-bool fixne(fixed_t f, fixed_t g);
+static inline bool fixlt(fixed_t f, fixed_t g) {
+	return f.v < g.v;
+}
+
+static inline bool fixgt(fixed_t f, fixed_t g) {
+	return f.v > g.v;
+}
+
+static inline bool fixle(fixed_t f, fixed_t g) {
+	return f.v <= g.v;
+}
+
+static inline bool fixge(fixed_t f, fixed_t g) {
+	return f.v >= g.v;
+}
+
+static inline bool fixeq(fixed_t f, fixed_t g) {
+	return f.v == g.v;
+}
+
+static inline bool fixne(fixed_t f, fixed_t g) {
+	return f.v != g.v;
+}
 
 /*
  * Return minimum and maximum.
  */
-fixed_t fixmin(fixed_t f, fixed_t g);
-fixed_t fixmax(fixed_t f, fixed_t g);
+static inline fixed_t fixmin(fixed_t f, fixed_t g) {
+	return fixlt(f, g) ? f : g;
+}
+
+static inline fixed_t fixmax(fixed_t f, fixed_t g) {
+	return fixgt(f, g) ? f : g;
+}
+
+/*
+ * A reciprocal as computed by fixrecip(). See fixmul_recip().
+ */
+typedef struct {
+	uint32_t mantissa;
+	int shift;
+} fixrecip_t;
+
+/*
+ * Computes the reciprocal of d, which must not be zero, so that
+ * dividing by d becomes a multiplication.
+ *
+ * The divisor is normalized, so that a single 32 bit division of
+ * its upper half gives a first approximation. One Newton-Raphson step
+ * then improves this to about 29 significant bits. The result is
+ * never too large.
+ */
+static inline fixrecip_t fixrecip(uint32_t d) {
+	int shift = __builtin_clz(d);
+	// norm/2^32 is in [0.5, 1).
+	uint32_t norm = d << shift;
+
+	// y approximates 2^62 / norm, i.e. the reciprocal of norm/2^32
+	// with 30 fractional bits.
+	uint32_t y = (0xffffffffu / ((norm >> 16) + 1)) << 14;
+	uint32_t e = (1u << 30) - (uint32_t) (((uint64_t) norm * y) >> 32);
+	y += (uint32_t) (((uint64_t) y * e) >> 30);
+
+	return (fixrecip_t) { y, 46 - shift };
+}
+
+/*
+ * Returns a * 65536 / d, where r = fixrecip(d).
+ *
+ * a * r.mantissa must fit in 64 bits.
+ */
+static inline uint32_t fixmul_recip(uint32_t a, fixrecip_t r) {
+	return (uint32_t) (((uint64_t) a * r.mantissa) >> r.shift);
+}
+
+/*
+ * Returns 1 / f, or FIX_MAX or FIX_MIN if it is out of range. Unlike
+ * fixdiv, this needs no 64 bit division, but the result may be
+ * slightly too small in magnitude.
+ */
+static inline fixed_t fixinv(fixed_t f) {
+	if (f.v == 0) {
+		return FIX_MAX;
+	}
+
+	uint32_t d = f.v < 0 ? -(uint32_t) f.v : (uint32_t) f.v;
+	fixrecip_t r = fixrecip(d);
+	// 1 / f is 2^32 / d in raw units, which may not fit in 32 bits.
+	int64_t inverse = ((uint64_t) 1 << FRAC_BITS) * r.mantissa >> r.shift;
+
+	return fix_saturate(f.v < 0 ? -inverse : inverse);
+}
 
 #endif
@@ -8,14 +8,31 @@ fi
 
 DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
 cd $DIR
+LOADER=led-board-loader.hex
 FIRMWARE=led-board.hex
+IMAGE=led-board.bin
 
+# The image info at the end of the firmware area (see update.h), which
+# the loader checks before it starts the firmware: the number of
+# 64-byte chunks, inverted in the upper half, and the CRC-32 of the
+# image padded with 0xff to whole chunks (taken from the gzip trailer).
+SIZE=$(stat -c %s $IMAGE)
+CHUNKS=$(( (SIZE + 63) / 64 ))
+CRC=$( { cat $IMAGE; head -c $(( CHUNKS * 64 - SIZE )) /dev/zero | tr '\0' '\377'; } |
+       gzip -c | tail -c 8 | od -An -tx4 -N4 | tr -d ' ' )
+INFO_CHUNKS=$(( CHUNKS | (~CHUNKS & 0xffff) << 16 ))
+
+# The firmware area is 0x08000800 to 0x08003bff, the config page after
+# it is kept.
 openocd \
     -f ../../config/openocd/olimex-arm-usb-tiny-h.cfg \
     -f ../../config/openocd/vaporlight.cfg \
     -c "init" \
     -c "halt" \
-    -c "flash write_image erase unlock $FIRMWARE" \
+    -c "flash erase_address unlock 0x08000800 13312" \
+    -c "flash write_image erase unlock $LOADER" \
+    -c "flash write_image $FIRMWARE" \
+    -c "flash fillw 0x08003bf8 $INFO_CHUNKS 1" \
+    -c "flash fillw 0x08003bfc 0x$CRC 1" \
     -c "reset" \
     -c "exit"
-
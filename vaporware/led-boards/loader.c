@@ -0,0 +1,400 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stm_include/stm32/dma.h"
+#include "stm_include/stm32/rcc.h"
+#include "stm_include/stm32/scb.h"
+#include "stm_include/stm32/usart.h"
+
+#include "config.h"
+#include "error.h"
+#include "flash.h"
+#include "update.h"
+
+/*
+ * The resident loader. It is what the processor starts after a reset,
+ * and lives in the first pages of flash, which an update never
+ * erases (see HACKING).
+ *
+ * It starts the firmware if the image info is valid and the image
+ * matches its CRC. If the firmware asked for an update, or there is
+ * no valid image, it stays and receives an image over the bus, and
+ * resets once the image has been written and checked.
+ *
+ * The loader is linked on its own (see loader.ld) and must not use
+ * initialized or zeroed static data, since nothing sets it up.
+ */
+
+// Frame payload of an update chunk: address, command code, chunk
+// index, data and CRC.
+#define CHUNK_FRAME_LEN (1 + 1 + 2 + UPDATE_CHUNK_SIZE + 4)
+
+// Frame payload of an update command: address, command code, magic,
+// number of chunks and CRC.
+#define START_FRAME_LEN (1 + 1 + 2 + 2 + 4)
+
+// Bus address all modules listen to.
+#define BROADCAST 0xff
+
+void loader();
+static void reset();
+
+/*
+ * Symbols provided by the linker.
+ */
+extern int _stack_end;
+
+/*
+ * The interrupt vector of the loader. This goes at the very start of
+ * Flash (starting at 0x0800 0000). The firmware has its own, which the
+ * loader switches to before starting it. No interrupts are enabled
+ * here, so only the exceptions are needed, and they all reset.
+ */
+void (*volatile loader_vectors[])() __attribute__ ((section (".isr_vector"))) = {
+	(void (*)()) &_stack_end, /* 0x0000: top of stack */
+	loader, /* 0x0004: reset */
+	reset, /* 0x0008: NMI */
+	reset, /* 0x000c: hard fault */
+	reset, /* 0x0010: memory management fault */
+	reset, /* 0x0014: bus fault */
+	reset, /* 0x0018: illegal instruction */
+};
+
+/*
+ * Resets the module.
+ */
+static void reset() {
+	SCB_AIRCR = SCB_AIRCR_VECTKEY | SCB_AIRCR_SYSRESETREQ;
+	while (1);
+}
+
+/*
+ * The flash functions report a locked flash here. There is nobody to
+ * tell in the loader, so it starts over.
+ */
+void error(err_reason_t reason, char *message, int length, err_action_t action) {
+	(void) reason;
+	(void) message;
+	(void) length;
+	(void) action;
+
+	reset();
+}
+
+/*
+ * Returns the CRC-32 (as used by zlib) of the length bytes at data.
+ */
+static uint32_t crc32(const uint8_t *data, int length) {
+	uint32_t crc = 0xffffffff;
+
+	for (int i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; b++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+/*
+ * Returns true if the image info is valid and the image in the
+ * firmware area matches it.
+ */
+static bool image_valid() {
+	const image_info_t *info = IMAGE_INFO;
+
+	if (info->chunks == 0 || info->chunks > UPDATE_MAX_CHUNKS ||
+	    (uint16_t) (info->chunks + info->chunks_inverted) != 0xffff) {
+		return false;
+	}
+
+	return crc32((const uint8_t*) FIRMWARE_START,
+		     info->chunks * UPDATE_CHUNK_SIZE) == info->crc;
+}
+
+/*
+ * Starts the firmware with its own vector table and stack, as if the
+ * processor had started it after a reset. The loader has not touched
+ * the clocks or peripherals at this point.
+ */
+static void start_firmware() {
+	const uint32_t *vectors = (const uint32_t*) FIRMWARE_START;
+
+	SCB_VTOR = FIRMWARE_START;
+	__asm("msr msp, %0\n\t"
+	      "bx %1"
+	      : : "r" (vectors[0]), "r" (vectors[1]));
+
+	while (1);
+}
+
+/*
+ * Initializes the clock and the peripherals the update needs: the
+ * same clock as the firmware, so that USART2 can use its baud rate,
+ * and USART2 receiving by DMA1 channel 6. USART2_RX is an input after
+ * reset, which is all the USART needs.
+ */
+static void update_init() {
+	// PLL source: Quartz via Prediv.
+	// PLL multiplication factor 3 (8MHz -> 24MHz)
+	RCC_CFGR |= (RCC_CFGR_PLLSRC_PREDIV1_CLK << 16) |
+		(RCC_CFGR_PLLMUL_PLL_CLK_MUL3 << 18);
+
+	// Start and wait for HSE.
+	RCC_CR |= RCC_CR_HSEON;
+	while (!(RCC_CR & RCC_CR_HSERDY));
+
+	// Start and wait for PLL.
+	RCC_CR |= RCC_CR_PLLON;
+	while (!(RCC_CR & RCC_CR_PLLRDY));
+
+	// Switch sysclock to PLL.
+	RCC_CFGR |= (RCC_CFGR_SW_SYSCLKSEL_PLLCLK << 0);
+
+	RCC_AHBENR |= RCC_AHBENR_FLITFEN |
+		RCC_AHBENR_DMA1EN;
+	RCC_APB2ENR |= RCC_APB2ENR_IOPAEN;
+	RCC_APB1ENR |= RCC_APB1ENR_USART2EN;
+
+	USART2_BRR = USART_BAUD_VALUE;
+	DMA1_CPAR6 = (uint32_t) &USART2_DR;
+	USART2_CR3 = USART_CR3_DMAR;
+	USART2_CR1 = USART_CR1_UE |
+		USART_CR1_RE;
+
+	flash_unlock();
+}
+
+/*
+ * Returns true if a frame sent to the given address is meant for this
+ * module, like the USART address filter of the firmware.
+ */
+static bool accepts_address(const update_request_t *request, uint8_t address) {
+	if (address == request->address || address == BROADCAST) {
+		return true;
+	}
+
+	for (int g = 0; g < GROUP_COUNT; g++) {
+		if (address == request->groups[g]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Forgets which chunks have been written and erases the firmware
+ * area, starting with the page of the image info.
+ *
+ * Returns false if a page could not be erased.
+ */
+static bool start_over(uint32_t *written) {
+	bool erased = true;
+
+	for (int i = 0; i < (UPDATE_MAX_CHUNKS + 31) / 32; i++) {
+		written[i] = 0;
+	}
+
+	for (int offset = FIRMWARE_SIZE - FLASH_PAGE_SIZE; offset >= 0; offset -= FLASH_PAGE_SIZE) {
+		if (flash_erase_page((void*) (FIRMWARE_START + offset)) != E_SUCCESS) {
+			erased = false;
+		}
+	}
+
+	return erased;
+}
+
+/*
+ * Receives an image from the bus and writes it to the firmware area.
+ * The update to receive is given by the request, which has no chunks
+ * if the loader waits for an update command. any_address accepts
+ * frames sent to any address, for a module that lost its firmware
+ * (and its idea of its address with it).
+ *
+ * A chunk that arrives again after it has been written is ignored. An
+ * end frame writes the image info and resets the module if the image
+ * is complete and its CRC matches. If the image is complete but
+ * broken, or a chunk could not be written, it is erased so that the
+ * next pass starts over. An update command for the image being
+ * received is ignored, one for another image restarts the transfer
+ * with it.
+ */
+static void receive_image(update_request_t *request, bool any_address) {
+	uint8_t dma_buffer[UPDATE_DMA_BUFFER_LEN];
+	// Halfwords, so that the chunk data can be passed to flash_copy.
+	uint16_t frame_buffer[(CHUNK_FRAME_LEN + 1) / 2];
+	uint8_t *frame = (uint8_t*) frame_buffer;
+	// One bit per chunk that has been written.
+	uint32_t written[(UPDATE_MAX_CHUNKS + 31) / 32];
+
+	DMA1_CCR6 = 0;
+	DMA1_CMAR6 = (uint32_t) &dma_buffer;
+	DMA1_CNDTR6 = UPDATE_DMA_BUFFER_LEN;
+	DMA1_CCR6 = (DMA_CCR6_PL_VERY_HIGH << DMA_CCR6_PL_LSB) |
+		(DMA_CCR6_MSIZE_8BIT << DMA_CCR6_MSIZE_LSB) |
+		(DMA_CCR6_PSIZE_8BIT << DMA_CCR6_PSIZE_LSB) |
+		DMA_CCR6_MINC |
+		DMA_CCR6_CIRC |
+		DMA_CCR6_EN;
+
+	bool broken = false;
+	if (request->chunks != 0) {
+		broken = !start_over(written);
+	}
+
+	int read_index = 0;
+	int length = 0;
+	bool receiving = false;
+	bool escaped = false;
+
+	while (1) {
+		int write_index = UPDATE_DMA_BUFFER_LEN - DMA1_CNDTR6;
+		if (write_index >= UPDATE_DMA_BUFFER_LEN) {
+			write_index = 0;
+		}
+		if (read_index == write_index) {
+			continue;
+		}
+
+		uint8_t in_byte = dma_buffer[read_index];
+		read_index++;
+		if (read_index == UPDATE_DMA_BUFFER_LEN) {
+			read_index = 0;
+		}
+
+		// Unescape like the USART2 ISR.
+		if (in_byte == START_MARK) {
+			receiving = true;
+			escaped = false;
+			length = 0;
+			continue;
+		}
+		if (!receiving) {
+			continue;
+		}
+		if (escaped) {
+			escaped = false;
+			if (in_byte == 0x00) {
+				in_byte = ESCAPE_MARK;
+			} else if (in_byte == 0x01) {
+				in_byte = START_MARK;
+			} else {
+				receiving = false;
+				continue;
+			}
+		} else if (in_byte == ESCAPE_MARK) {
+			escaped = true;
+			continue;
+		}
+
+		frame[length++] = in_byte;
+
+		if (length == 1) {
+			if (!any_address && !accepts_address(request, in_byte)) {
+				receiving = false;
+			}
+		} else if (length == 2 && in_byte == UPDATE_END) {
+			receiving = false;
+
+			if (request->chunks == 0) {
+				continue;
+			}
+
+			bool complete = true;
+			for (int c = 0; c < request->chunks; c++) {
+				if (!(written[c / 32] & (1u << (c % 32)))) {
+					complete = false;
+				}
+			}
+
+			if (complete && !broken &&
+			    crc32((uint8_t*) FIRMWARE_START,
+				  request->chunks * UPDATE_CHUNK_SIZE) == request->crc) {
+				image_info_t info = {
+					.chunks = request->chunks,
+					.chunks_inverted = ~request->chunks,
+					.crc = request->crc,
+				};
+
+				if (flash_copy((void*) IMAGE_INFO, &info,
+					       sizeof(info) / 2) == E_SUCCESS) {
+					reset();
+				}
+				broken = true;
+			}
+
+			if (complete || broken) {
+				broken = !start_over(written);
+			}
+		} else if (length == 2 && in_byte != UPDATE_CHUNK && in_byte != UPDATE_START) {
+			receiving = false;
+		} else if (length == START_FRAME_LEN && frame[1] == UPDATE_START) {
+			receiving = false;
+
+			int chunks = (frame[4] << 8) + frame[5];
+			uint32_t crc = ((uint32_t) frame[6] << 24) + (frame[7] << 16) +
+				(frame[8] << 8) + frame[9];
+			if (frame[2] != 'V' || frame[3] != 'L' ||
+			    chunks == 0 || chunks > UPDATE_MAX_CHUNKS ||
+			    (chunks == request->chunks && crc == request->crc)) {
+				continue;
+			}
+
+			request->chunks = chunks;
+			request->crc = crc;
+			broken = !start_over(written);
+		} else if (length == CHUNK_FRAME_LEN) {
+			receiving = false;
+
+			int index = (frame[2] << 8) + frame[3];
+			uint32_t crc = ((uint32_t) frame[CHUNK_FRAME_LEN - 4] << 24) +
+				(frame[CHUNK_FRAME_LEN - 3] << 16) +
+				(frame[CHUNK_FRAME_LEN - 2] << 8) +
+				frame[CHUNK_FRAME_LEN - 1];
+
+			if (index >= request->chunks ||
+			    (written[index / 32] & (1u << (index % 32))) ||
+			    crc32(frame + 2, 2 + UPDATE_CHUNK_SIZE) != crc) {
+				continue;
+			}
+
+			if (flash_copy((void*) (FIRMWARE_START + index * UPDATE_CHUNK_SIZE),
+				       frame + 4, UPDATE_CHUNK_SIZE / 2) == E_SUCCESS) {
+				written[index / 32] |= 1u << (index % 32);
+			} else {
+				broken = true;
+			}
+		}
+	}
+}
+
+/*
+ * Entry point of the loader. Takes the update request the firmware
+ * left in RAM, if any, and starts the firmware unless there is an
+ * update to receive or the image is not valid.
+ */
+void loader() {
+	update_request_t request = {
+		.chunks = 0,
+	};
+	bool requested = UPDATE_REQUEST->magic == UPDATE_REQUEST_MAGIC &&
+		UPDATE_REQUEST->chunks <= UPDATE_MAX_CHUNKS;
+
+	if (requested) {
+		request.crc = UPDATE_REQUEST->crc;
+		request.chunks = UPDATE_REQUEST->chunks;
+		request.address = UPDATE_REQUEST->address;
+		for (int g = 0; g < GROUP_COUNT; g++) {
+			request.groups[g] = UPDATE_REQUEST->groups[g];
+		}
+		// Only this reset is meant for the update.
+		UPDATE_REQUEST->magic = 0;
+	} else if (image_valid()) {
+		start_firmware();
+	}
+
+	update_init();
+	receive_image(&request, !requested);
+}
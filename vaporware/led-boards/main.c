@@ -8,20 +8,18 @@
 #include "config.h"
 #include "console.h"
 #include "debug.h"
+#include "effect.h"
 #include "error.h"
+#include "event.h"
+#include "fade.h"
 #include "fail.h"
 #include "git_version.h"
 #include "heat.h"
 #include "pwm.h"
+#include "stats.h"
 #include "usart1.h"
 #include "usart2.h"
 
-/*
- * Set to 1 by the systick timer when a heat check
- * should be done.
- */
-volatile int do_heat_check;
-
 /*
  * What to do when overheat is detected.
  */
@@ -73,6 +71,7 @@ int main() {
 	heat_init(panic_on_overheat);
 
 	ret = load_config();
+	color_prepare();
 
 	// Display the version number on lights during bootup
 	display_boot_colors(ret == E_SUCCESS);
@@ -108,11 +107,22 @@ int main() {
 
 	// We are now, regardless of the value of mode, in normal mode.
 
+	// Trace output must not stall the main loop.
+	usart1_set_blocking(0);
+
+	stats_init();
 	command_init();
 	usart2_init();
 
 	while (1) {
-		command = usart2_next_command();
+		uint32_t events = event_wait();
+
+		if (events & EVENT_BIT(EVENT_COMMAND)) {
+			command_apply_decoded();
+			command = usart2_next_command();
+		} else {
+			command = (unsigned char*) 0;
+		}
 
 		if (command != (unsigned char*) 0) {
 #ifdef TRACE_COMMANDS
@@ -130,15 +140,27 @@ int main() {
 				}
 #endif
 			}
+
+			// Run only one command at a time, so that a full
+			// queue does not delay the other events. The
+			// next call frees this command's buffer.
+			event_post(EVENT_COMMAND);
 		}
 
-		if (do_heat_check) {
+		if (events & EVENT_BIT(EVENT_PERIOD)) {
+			fade_tick();
+			effect_tick();
+		}
+
+		if (events & EVENT_BIT(EVENT_HEAT)) {
 #ifdef TRACE_HEAT
 			debug_string("H\n");
 #endif
 			heat_timer_tick();
+		}
 
-			do_heat_check = 0;
+		if (events & EVENT_BIT(EVENT_CONSOLE)) {
+			stats_poll();
 		}
 	}
 
@@ -5,8 +5,6 @@
 #ifndef MAIN_H
 #define MAIN_H
 
-extern volatile int do_heat_check;
-
 int main();
 
 #endif
@@ -1,7 +1,13 @@
 #include "pwm.h"
 
 #include "config.h"
+#include "event.h"
+#include "sync.h"
+#ifdef COUNT_DITHER_ISR
+	#include "debug.h"
+#endif
 
+#include "stm_include/stm32/nvic.h"
 #include "stm_include/stm32/timer.h"
 
 /*
@@ -18,12 +24,39 @@ static uint32_t TIMERS[TIMER_COUNT] = {
 };
 
 /*
- * The raw PWM values for the LEDs.
+ * Two sets of raw PWM values for the LEDs. pwm_values points to the
+ * current one, the other one can be filled by the USART2 ISR (see
+ * pwm_back_values) and is then made current by pwm_swap_values.
  */
-static uint16_t pwm_values[MODULE_LENGTH] = {
+static uint16_t pwm_value_sets[2][MODULE_LENGTH] = {
+	[0 ... 1] = { [0 ... MODULE_LENGTH - 1] = 0x00 }
+};
+static uint16_t *pwm_values = pwm_value_sets[0];
+
+/*
+ * The values last sent to the hardware PWM registers. These differ
+ * from pwm_values during a fade.
+ */
+static uint16_t pwm_output[MODULE_LENGTH] = {
+	[0 ... MODULE_LENGTH - 1] = 0x00
+};
+
+/*
+ * pwm_output with DITHER_BITS fractional bits.
+ */
+static uint32_t pwm_fine[MODULE_LENGTH] = {
+	[0 ... MODULE_LENGTH - 1] = 0x00
+};
+
+/*
+ * The sum of the fractional parts not shown yet, for each channel.
+ */
+static uint32_t dither_error[MODULE_LENGTH] = {
 	[0 ... MODULE_LENGTH - 1] = 0x00
 };
 
+#define DITHER_ONE (1 << DITHER_BITS)
+
 /*
  * Functions to manipulate one register in all the timers. Make sure that the
  * register in question is available in all timers (see defines in led.h).
@@ -40,13 +73,11 @@ static void or_each(uint32_t reg_offset, int value) {
 	}
 }
 
-/* Unused for now...
 static void and_each(uint32_t reg_offset, int value) {
 	for (int i = 0; i < TIMER_COUNT; i++) {
 		TR(TIMERS[i], reg_offset) &= value;
 	}
 }
-*/
 
 /*
  * Enable all C/C outputs.
@@ -84,26 +115,28 @@ void pwm_init() {
 	// ARR = PWM_RELOAD
 	// Send OCxREF to OCx output (CCxE = 1, CCxNE = 0)
 	// PWM mode 1
-	// ... the right register preloading magic.
+	// ARR and CCRx preloaded, so that new values only take
+	// effect on the next update event (see pwm_send_frame).
 
 	set_each(CR1, TIM_CR1_CKD_CK_INT | // Dead-time-clock = internal clock
 		 TIM_CR1_CMS_EDGE |        // Edge mode
-		 TIM_CR1_DIR_UP);          // Count up
+		 TIM_CR1_DIR_UP |          // Count up
+		 TIM_CR1_ARPE);            // Preload ARR
 
 
 
-	// Set all outputs to PWM mode 1.
+	// Set all outputs to PWM mode 1 with preloaded CCR.
 	// Cannot use set_each here, because timers have
 	// different numbers of channels.
-	TR(TIM1 , CCMR1) = TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC1M_PWM1;
-	TR(TIM1 , CCMR2) = TIM_CCMR2_OC4M_PWM1 | TIM_CCMR2_OC3M_PWM1;
-	TR(TIM2 , CCMR1) = TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC1M_PWM1;
-	TR(TIM2 , CCMR2) = TIM_CCMR2_OC4M_PWM1 | TIM_CCMR2_OC3M_PWM1;
-	TR(TIM3 , CCMR1) = TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC1M_PWM1;
-	TR(TIM3 , CCMR2) = TIM_CCMR2_OC4M_PWM1 | TIM_CCMR2_OC3M_PWM1;
-	TR(TIM15, CCMR1) = TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC1M_PWM1;
-	TR(TIM16, CCMR1) = TIM_CCMR1_OC1M_PWM1;
-	TR(TIM17, CCMR1) = TIM_CCMR1_OC1M_PWM1;
+	TR(TIM1 , CCMR1) = TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC2PE | TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC1PE;
+	TR(TIM1 , CCMR2) = TIM_CCMR2_OC4M_PWM1 | TIM_CCMR2_OC4PE | TIM_CCMR2_OC3M_PWM1 | TIM_CCMR2_OC3PE;
+	TR(TIM2 , CCMR1) = TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC2PE | TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC1PE;
+	TR(TIM2 , CCMR2) = TIM_CCMR2_OC4M_PWM1 | TIM_CCMR2_OC4PE | TIM_CCMR2_OC3M_PWM1 | TIM_CCMR2_OC3PE;
+	TR(TIM3 , CCMR1) = TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC2PE | TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC1PE;
+	TR(TIM3 , CCMR2) = TIM_CCMR2_OC4M_PWM1 | TIM_CCMR2_OC4PE | TIM_CCMR2_OC3M_PWM1 | TIM_CCMR2_OC3PE;
+	TR(TIM15, CCMR1) = TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC2PE | TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC1PE;
+	TR(TIM16, CCMR1) = TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC1PE;
+	TR(TIM17, CCMR1) = TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC1PE;
 
 	set_each(ARR, PWM_RELOAD);
 
@@ -122,6 +155,10 @@ void pwm_init() {
 	// Force the registers to be actually loaded.
 	or_each(EGR, TIM_EGR_UG);
 
+	// Interrupt at the start of each period, see isr_tim2.
+	TR(TIM2, DIER) = TIM_DIER_UIE;
+	NVIC_ISER(0) |= (1 << NVIC_TIM2_IRQ);
+
 	// Finally enable the timers.
 	or_each(CR1, TIM_CR1_CEN);
 }
@@ -172,15 +209,160 @@ error_t pwm_set_brightness(uint8_t led, uint16_t brightness) {
 	}
 }
 
+/*
+ * Returns the set of brightness values (indexed by PWM channel) that
+ * is not in use. It may be filled while the current values are being
+ * changed and sent, and then replace them with pwm_swap_values.
+ */
+uint16_t *pwm_back_values() {
+	if (pwm_values == pwm_value_sets[0]) {
+		return pwm_value_sets[1];
+	} else {
+		return pwm_value_sets[0];
+	}
+}
+
+/*
+ * Makes the values written to pwm_back_values the current brightness
+ * values without copying them. The previous values become the back
+ * set.
+ */
+void pwm_swap_values() {
+	pwm_values = pwm_back_values();
+}
+
+/*
+ * Returns the brightness value last set for the given PWM channel.
+ */
+uint16_t pwm_get_brightness(uint8_t led) {
+	if (led >= MODULE_LENGTH) {
+		error(ER_BUG, STR_WITH_LEN("LED index out of range"), EA_RESUME);
+		return 0;
+	} else {
+		return pwm_values[led];
+	}
+}
+
+/*
+ * Returns the value last sent to the hardware for the given PWM
+ * channel.
+ */
+uint16_t pwm_get_output(uint8_t led) {
+	if (led >= MODULE_LENGTH) {
+		error(ER_BUG, STR_WITH_LEN("LED index out of range"), EA_RESUME);
+		return 0;
+	} else {
+		return pwm_output[led];
+	}
+}
+
+/*
+ * Sends the given MODULE_LENGTH values (indexed by PWM channel) to the
+ * hardware PWM registers. The values set by pwm_set_brightness are not
+ * changed.
+ *
+ * The CCR registers are preloaded, so the values only become active
+ * on the next update event of each timer, i.e. at the start of a PWM
+ * period. Update events are disabled while the registers are written,
+ * so a period never shows a partially written frame.
+ */
+void pwm_send_values(const uint16_t *values) {
+	uint32_t fine[MODULE_LENGTH];
+
+	for (int i = 0; i < MODULE_LENGTH; i++) {
+		fine[i] = values[i] << DITHER_BITS;
+	}
+
+	pwm_send_fine(fine);
+}
+
+/*
+ * Like pwm_send_values, but the values have DITHER_BITS fractional
+ * bits. The fractional parts are only shown if CONFIG_DITHER is set,
+ * in which case the values take effect one PWM period later.
+ */
+void pwm_send_fine(const uint32_t *values) {
+	interrupts_off();
+	for (int i = 0; i < MODULE_LENGTH; i++) {
+		pwm_fine[i] = values[i];
+		pwm_output[i] = values[i] >> DITHER_BITS;
+	}
+	interrupts_on();
+
+	// When dithering, isr_tim2 writes the registers at the start
+	// of the next period.
+	if (config.flags & CONFIG_DITHER) {
+		return;
+	}
+
+	or_each(CR1, TIM_CR1_UDIS);
+
+	for (int i = 0; i < MODULE_LENGTH; i++) {
+		*TIMER_CHANNELS[i] = pwm_output[i];
+	}
+
+	and_each(CR1, ~TIM_CR1_UDIS);
+}
+
 /*
  * Sends the status of all PWM channels to the hardware PWM registers.
  *
  * Returns an error/success code.
  */
 error_t pwm_send_frame() {
-	for (int i = 0; i < MODULE_LENGTH; i++) {
-		*TIMER_CHANNELS[i] = pwm_values[i];
-	}
+	pwm_send_values(pwm_values);
 
 	return E_SUCCESS;
 }
+
+/*
+ * ISR for the TIM2 update event, i.e. the start of a PWM period. Posts
+ * EVENT_PERIOD, which can be used as a timer tick of PWM_TICK_RATE Hz.
+ *
+ * If dithering is enabled, this computes the compare values for the
+ * next period: Each channel accumulates the fractional part of its
+ * value and is shown one step brighter whenever the sum exceeds one
+ * (first order sigma-delta modulation).
+ */
+void __attribute__ ((interrupt("IRQ"))) isr_tim2() {
+#ifdef COUNT_DITHER_ISR
+	static int max_cycles = 0;
+	static int periods = 0;
+	cycle_start();
+#endif
+
+	// rc_w0 bits: writing 1 leaves the other flags alone.
+	TR(TIM2, SR) = ~TIM_SR_UIF;
+	event_post(EVENT_PERIOD);
+
+	if (config.flags & CONFIG_DITHER) {
+		for (int i = 0; i < MODULE_LENGTH; i++) {
+			uint32_t value = pwm_fine[i] >> DITHER_BITS;
+			uint32_t error = dither_error[i] + (pwm_fine[i] & (DITHER_ONE - 1));
+
+			if (error >= DITHER_ONE) {
+				error -= DITHER_ONE;
+				if (value < 0xffff) {
+					value++;
+				}
+			}
+
+			dither_error[i] = error;
+			*TIMER_CHANNELS[i] = value;
+		}
+	}
+
+#ifdef COUNT_DITHER_ISR
+	// Report the most expensive run about once per second.
+	int cycles = cycle_get();
+	if (cycles > max_cycles) {
+		max_cycles = cycles;
+	}
+	if (++periods == PWM_TICK_RATE) {
+		debug_string("DT2");
+		debug_write((char*) &max_cycles, 4);
+		max_cycles = 0;
+		periods = 0;
+	}
+#endif
+}
@@ -1,6 +1,7 @@
 #ifndef LED_H
 #define LED_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "stm_include/stm32/timer.h"
 
@@ -84,11 +85,62 @@ void pwm_set_state(pwm_state_t state);
  */
 error_t pwm_set_brightness(uint8_t led, uint16_t brightness);
 
+/*
+ * Returns the set of brightness values (indexed by PWM channel) that
+ * is not in use. It may be filled while the current values are being
+ * changed and sent, and then replace them with pwm_swap_values.
+ */
+uint16_t *pwm_back_values();
+
+/*
+ * Makes the values written to pwm_back_values the current brightness
+ * values without copying them. The previous values become the back
+ * set.
+ */
+void pwm_swap_values();
+
+/*
+ * Returns the brightness value last set for the given PWM channel.
+ */
+uint16_t pwm_get_brightness(uint8_t led);
+
+/*
+ * Returns the value last sent to the hardware for the given PWM
+ * channel.
+ */
+uint16_t pwm_get_output(uint8_t led);
+
+/*
+ * Sends the given MODULE_LENGTH values (indexed by PWM channel) to the
+ * hardware PWM registers. The values set by pwm_set_brightness are not
+ * changed.
+ *
+ * The new values become active together at the start of the next PWM
+ * period.
+ */
+void pwm_send_values(const uint16_t *values);
+
+/*
+ * Like pwm_send_values, but the values have DITHER_BITS fractional
+ * bits. The fractional parts are only shown if CONFIG_DITHER is set,
+ * in which case the values take effect one PWM period later.
+ */
+void pwm_send_fine(const uint32_t *values);
+
 /*
  * Sends the status of all PWM channels to the hardware PWM registers.
  *
+ * The new values become active together at the start of the next PWM
+ * period.
+ *
  * Returns an error/success code.
  */
 error_t pwm_send_frame();
 
+/*
+ * ISR for the TIM2 update event, i.e. the start of a PWM period. Posts
+ * EVENT_PERIOD.
+ */
+void isr_tim2();
+
 #endif
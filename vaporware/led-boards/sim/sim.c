@@ -0,0 +1,397 @@
+/*
+ * Host simulation of an LED board.
+ *
+ * The firmware sources are compiled for the host, with the peripheral
+ * registers mapped to plain memory (see sim_hw.c). A recorded bus
+ * byte stream (e.g. written by vlpp::bus_writer to a file) is fed
+ * through isr_dispatch() as if it was received by USART2, and the
+ * commands are run like in the main loop. Afterwards, the resulting
+ * PWM values, the errors and the time spent in each stage are
+ * printed.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim_hw.h"
+#include "sim_stubs.h"
+
+#include "../color.h"
+#include "../command.h"
+#include "../config.h"
+#include "../effect.h"
+#include "../event.h"
+#include "../fade.h"
+#include "../pwm.h"
+#include "../stats.h"
+#include "../term.h"
+#include "../usart2.h"
+#include "../stm_include/stm32/usart.h"
+
+// Bus time per byte (start, 8 data and stop bit) in CPU cycles.
+#define BYTE_CYCLES (10ULL * (CPU_CLOCK) / (BUS_BAUDRATE))
+// Length of a PWM period in CPU cycles.
+#define PERIOD_CYCLES ((PWM_RELOAD) + 1ULL)
+
+/*
+ * Timing statistics of one stage.
+ */
+typedef struct {
+	unsigned long count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+} stage_t;
+
+// Bytes are timed together between two polls, so that the clock
+// does not dominate. max_ns is the longest of these runs.
+static stage_t rx_stage;
+static stage_t command_stages[256];
+static stage_t tick_stage;
+static stage_t period_stage;
+
+// Simulated time in CPU cycles, and the time of the next update
+// event of the PWM timers.
+static uint64_t sim_cycles;
+static uint64_t next_period = PERIOD_CYCLES;
+
+static const char *command_name(int code) {
+	switch (code) {
+	case 0x00: return "set-raw";
+	case 0x01: return "set-xyY";
+	case 0x02: return "set-masked";
+	case 0x03: return "set-bulk";
+	case 0x04: return "fade";
+	case 0x05: return "set-raw8";
+	case 0x06: return "effect";
+	case 0x07: return "update";
+	case 0xff: return "strobe";
+	default:   return "unknown";
+	}
+}
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stage_add(stage_t *stage, unsigned long count, uint64_t ns) {
+	stage->count += count;
+	stage->total_ns += ns;
+	if (ns > stage->max_ns) {
+		stage->max_ns = ns;
+	}
+}
+
+/*
+ * Sets up a configuration for modules without one: LED l uses the
+ * PWM channels 3l to 3l+2 and has sRGB primaries, channel 15 is the
+ * backup channel.
+ */
+static void default_config() {
+	static const fixed_t xy[3][2] = {
+		{ FIXINIT(0.64), FIXINIT(0.33) },
+		{ FIXINIT(0.30), FIXINIT(0.60) },
+		{ FIXINIT(0.15), FIXINIT(0.06) }
+	};
+	static const fixed_t peak_Y[3] = {
+		FIXINIT(0.2126), FIXINIT(0.7152), FIXINIT(0.0722)
+	};
+
+	for (int l = 0; l < RGB_LED_COUNT; l++) {
+		fixed_t matrix[9], inverse[9];
+
+		for (int c = 0; c < 3; c++) {
+			matrix[c] = xy[c][0];
+			matrix[3 + c] = xy[c][1];
+			matrix[6 + c] = FIXNUM(1.0);
+
+			config.led_infos[l].peak_Y[c] = peak_Y[c];
+			config.led_infos[l].channels[c] = 3 * l + c;
+		}
+
+		invert_3x3(matrix, inverse);
+		memcpy(config.led_infos[l].color_matrix, inverse, sizeof(inverse));
+	}
+
+	config.backup_channel = MODULE_LENGTH - 1;
+}
+
+/*
+ * Advances the simulated time. The TIM2 update interrupt is run for
+ * each PWM period that ends.
+ */
+static void advance(uint64_t cycles) {
+	sim_cycles += cycles;
+	while (next_period <= sim_cycles) {
+		uint64_t start = now_ns();
+		isr_tim2();
+		stage_add(&period_stage, 1, now_ns() - start);
+
+		next_period += PERIOD_CYCLES;
+	}
+}
+
+/*
+ * Handles the pending events like the main loop, until there are
+ * none left.
+ */
+static void run_main_loop() {
+	unsigned char *command;
+
+	uint32_t events;
+
+	while ((events = event_take()) != 0) {
+		if (events & EVENT_BIT(EVENT_COMMAND)) {
+			command_apply_decoded();
+			command = usart2_next_command();
+		} else {
+			command = (unsigned char*) 0;
+		}
+
+		if (command != (unsigned char*) 0) {
+			uint64_t start = now_ns();
+			error_t ret = run_command(command);
+			stage_add(&command_stages[command[0]], 1, now_ns() - start);
+
+			if (ret != E_SUCCESS) {
+				error(ER_USART_RX, STR_WITH_LEN("Bogus USART command."), EA_RESUME);
+			}
+
+			event_post(EVENT_COMMAND);
+		}
+
+		if (events & EVENT_BIT(EVENT_PERIOD)) {
+			uint64_t start = now_ns();
+			fade_tick();
+			effect_tick();
+			stage_add(&tick_stage, 1, now_ns() - start);
+		}
+	}
+}
+
+static void print_stage(const char *name, const stage_t *stage, const char *unit) {
+	printf("  %-12s %9lu %s, %8.1f ns avg, %8llu ns max\n", name,
+	       stage->count, unit,
+	       stage->count ? (double) stage->total_ns / stage->count : 0.0,
+	       (unsigned long long) stage->max_ns);
+}
+
+/*
+ * Times color_correct and invert_3x3, which do most of the fixed
+ * point arithmetic, and prints the average time per call.
+ */
+static void benchmark() {
+	const int rounds = 1000000;
+	uint32_t checksum = 0;
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++) {
+		uint16_t rgb[3];
+		uint16_t x = 10000 + (i * 7) % 20000;
+		uint16_t y = 10000 + (i * 13) % 20000;
+		uint16_t Y = i * 31;
+
+		color_correct(i % RGB_LED_COUNT, x, y, Y, rgb);
+		checksum += rgb[0] + rgb[1] + rgb[2];
+	}
+	uint64_t correct_ns = now_ns() - start;
+
+	start = now_ns();
+	for (int i = 0; i < rounds; i++) {
+		fixed_t matrix[9] = {
+			FIXINIT(0.64), FIXINIT(0.30), FIXINIT(0.15),
+			FIXINIT(0.33), FIXINIT(0.60), FIXINIT(0.06),
+			FIXINIT(1.0),  FIXINIT(1.0),  FIXINIT(1.0)
+		};
+		fixed_t inverse[9];
+
+		matrix[i % 6].v += i & 0xff;
+		invert_3x3(matrix, inverse);
+		checksum += inverse[i % 9].v;
+	}
+	uint64_t invert_ns = now_ns() - start;
+
+	printf("Benchmark (%d calls each, checksum %08x):\n", rounds, (unsigned) checksum);
+	printf("  color_correct %8.1f ns avg\n", (double) correct_ns / rounds);
+	printf("  invert_3x3    %8.1f ns avg\n", (double) invert_ns / rounds);
+}
+
+static void usage(const char *prg) {
+	fprintf(stderr,
+		"Usage: %s [-a address] [-b] [-d] [-g group] [-i] [-p bytes] [-t ms] [-v] [file]\n"
+		"  -a address  bus address of the simulated module (default 0)\n"
+		"  -b          benchmark the color correction instead\n"
+		"  -d          dither PWM values (CONFIG_DITHER)\n"
+		"  -g group    also accept this group address (up to "
+		XSTR(GROUP_COUNT) " times)\n"
+		"  -i          interpolate between frames (CONFIG_INTERPOLATE)\n"
+		"  -p bytes    run the received commands every this many bytes\n"
+		"              (default 1, larger values provoke overflows)\n"
+		"  -t ms       keep running for this long after the input ended\n"
+		"  -v          print console output and all errors\n"
+		"The bus byte stream is read from file or stdin.\n", prg);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int address = 0;
+	int groups = 0;
+	long poll_interval = 1;
+	long idle_ms = 0;
+	bool interpolate = false;
+	bool dither = false;
+	bool bench = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:bdg:ip:t:v")) != -1) {
+		switch (opt) {
+		case 'a':
+			address = atoi(optarg);
+			break;
+		case 'b':
+			bench = true;
+			break;
+		case 'd':
+			dither = true;
+			break;
+		case 'g':
+			if (groups == GROUP_COUNT) {
+				usage(argv[0]);
+			}
+			config.groups[groups++] = atoi(optarg);
+			break;
+		case 'i':
+			interpolate = true;
+			break;
+		case 'p':
+			poll_interval = atol(optarg);
+			break;
+		case 't':
+			idle_ms = atol(optarg);
+			break;
+		case 'v':
+			sim_verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc - 1 || address < 0 || address > 0xfe || poll_interval < 1 || idle_ms < 0) {
+		usage(argv[0]);
+	}
+
+	FILE *in = stdin;
+	if (optind < argc && strcmp(argv[optind], "-") != 0) {
+		in = fopen(argv[optind], "rb");
+		if (!in) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	sim_hw_init();
+
+	if (load_config() != E_SUCCESS) {
+		default_config();
+	}
+	config.my_address = address;
+	if (interpolate) {
+		config.flags |= CONFIG_INTERPOLATE;
+	}
+	if (dither) {
+		config.flags |= CONFIG_DITHER;
+	}
+	color_prepare();
+
+	if (bench) {
+		benchmark();
+		return 0;
+	}
+
+	pwm_init();
+	command_init();
+	usart2_init();
+
+	unsigned char chunk[4096];
+	size_t length;
+	long since_poll = 0;
+	while ((length = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+		size_t pos = 0;
+
+		while (pos < length) {
+			size_t n = length - pos;
+			if (n > (size_t) (poll_interval - since_poll)) {
+				n = poll_interval - since_poll;
+			}
+
+			uint64_t start = now_ns();
+			for (size_t i = pos; i < pos + n; i++) {
+				isr_dispatch(USART_SR_RXNE, chunk[i]);
+			}
+			stage_add(&rx_stage, n, now_ns() - start);
+			advance(n * BYTE_CYCLES);
+
+			pos += n;
+			since_poll += n;
+			if (since_poll == poll_interval) {
+				run_main_loop();
+				since_poll = 0;
+			}
+		}
+	}
+	run_main_loop();
+
+	uint64_t end = sim_cycles + (uint64_t) idle_ms * (CPU_CLOCK / 1000);
+	while (next_period <= end) {
+		advance(next_period - sim_cycles);
+		run_main_loop();
+	}
+
+	if (in != stdin) {
+		fclose(in);
+	}
+
+	printf("Simulated %.1f ms\n", sim_cycles * 1000.0 / CPU_CLOCK);
+	printf("Stages:\n");
+	print_stage("receive", &rx_stage, "bytes ");
+	for (int c = 0; c < 256; c++) {
+		if (command_stages[c].count) {
+			print_stage(command_name(c), &command_stages[c], "cmds  ");
+		}
+	}
+	print_stage("fade tick", &tick_stage, "ticks ");
+	print_stage("period isr", &period_stage, "ticks ");
+
+	printf("Errors:\n");
+	for (int e = 0; e < SIM_ER_COUNT; e++) {
+		if (sim_errors[e]) {
+			printf("  %-16s %lu\n", sim_error_names[e], sim_errors[e]);
+		}
+	}
+	if (sim_errors[SIM_ER_CMDOVERFLOW]) {
+		printf("  (each command overflow is one or more dropped commands)\n");
+	}
+
+	printf("Counters:\n");
+	printf("  frames accepted  %lu\n", (unsigned long) stats.frames_accepted);
+	printf("  frames filtered  %lu\n", (unsigned long) stats.frames_filtered);
+	printf("  bad escapes      %lu\n", (unsigned long) stats.bad_escapes);
+	printf("  overflows        %lu\n", (unsigned long) stats.overflows);
+	printf("  usart errors     %lu\n", (unsigned long) stats.usart_errors);
+	printf("  strobes          %lu\n", (unsigned long) stats.strobes);
+	printf("  commands         %lu\n", (unsigned long) stats.commands);
+
+	printf("PWM values:\n ");
+	for (int i = 0; i < MODULE_LENGTH; i++) {
+		printf(" %5u", (unsigned) *TIMER_CHANNELS[i]);
+	}
+	printf("\n");
+
+	return 0;
+}
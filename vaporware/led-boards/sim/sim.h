@@ -0,0 +1,16 @@
+/*
+ * Forcibly included (gcc -include) into every firmware source when
+ * building the host simulation. It removes the ARM specific parts
+ * that cannot be compiled for the host.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+// Interrupt handlers are called like normal functions.
+#define interrupt(x)
+
+// There are no interrupts to enable or disable, and nop loops need
+// not be kept.
+#define __asm(...) ((void) 0)
+
+#endif
@@ -0,0 +1,40 @@
+#define _DEFAULT_SOURCE
+
+#include "sim_hw.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/*
+ * The register regions accessed by the firmware.
+ */
+static const struct {
+	unsigned long base;
+	unsigned long size;
+} regions[] = {
+	// APB1, APB2 and AHB peripherals (timers, USARTs, GPIO, DMA, flash)
+	{ 0x40000000, 0x30000 },
+	// Cortex-M3 system control (DWT, NVIC, SCB)
+	{ 0xe0000000, 0x10000 }
+};
+
+/*
+ * Maps plain memory at the addresses of the peripheral and system
+ * control registers, so that the firmware can access them as on the
+ * controller. Must be called before any firmware function.
+ *
+ * Exits the program if the memory cannot be mapped.
+ */
+void sim_hw_init() {
+	for (unsigned r = 0; r < sizeof(regions) / sizeof(regions[0]); r++) {
+		void *want = (void*) regions[r].base;
+		void *got = mmap(want, regions[r].size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+		if (got != want) {
+			fprintf(stderr, "Cannot map registers at %p\n", want);
+			exit(1);
+		}
+	}
+}
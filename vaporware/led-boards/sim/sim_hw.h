@@ -0,0 +1,13 @@
+#ifndef SIM_HW_H
+#define SIM_HW_H
+
+/*
+ * Maps plain memory at the addresses of the peripheral and system
+ * control registers, so that the firmware can access them as on the
+ * controller. Must be called before any firmware function.
+ *
+ * Exits the program if the memory cannot be mapped.
+ */
+void sim_hw_init();
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Replacements for the parts of the firmware that only make sense on
+ * the controller: the console (which talks to USART1), the error
+ * handler (which blinks the debug LED) and the bus update (which
+ * rewrites the flash).
+ */
+#include "sim_stubs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../console.h"
+#include "../update.h"
+#include "../usart1.h"
+
+unsigned long sim_errors[SIM_ER_COUNT];
+
+const char *const sim_error_names[SIM_ER_COUNT] = {
+	"no config",
+	"bug",
+	"heat",
+	"usart rx",
+	"flash write",
+	"command overflow",
+	"other"
+};
+
+bool sim_verbose = false;
+
+void console_putchar(const char message) {
+	if (sim_verbose) {
+		fputc(message, stderr);
+	}
+}
+
+void console_write_raw(const char *message, unsigned length) {
+	if (sim_verbose) {
+		fwrite(message, 1, length, stderr);
+	}
+}
+
+void console_uint(unsigned value, unsigned base, int min_width, char padding) {
+	(void) padding;
+	if (sim_verbose) {
+		fprintf(stderr, base == 16 ? "%*x" : "%*u", min_width, value);
+	}
+}
+
+void console_sint(int value, unsigned base, int min_width, char padding) {
+	(void) padding;
+	if (sim_verbose) {
+		fprintf(stderr, base == 16 ? "%*x" : "%*d", min_width, value);
+	}
+}
+
+void console_fixed(fixed_t value, unsigned base) {
+	(void) base;
+	if (sim_verbose) {
+		fprintf(stderr, "%f", value.v / 65536.0);
+	}
+}
+
+/*
+ * Nothing is ever received on the debug USART.
+ */
+int usart1_has_input() {
+	return 0;
+}
+
+char usart1_getchar() {
+	return '\0';
+}
+
+int usart1_set_blocking(int blocking) {
+	return blocking;
+}
+
+uint32_t usart1_dropped() {
+	return 0;
+}
+
+/*
+ * Counts the error. A panic or reset ends the simulation, because
+ * the module would not process any further commands.
+ */
+void error(err_reason_t reason, char *message, int length, err_action_t action) {
+	sim_error_t index;
+
+	switch (reason) {
+	case ER_NO_CONFIG:   index = SIM_ER_NO_CONFIG;   break;
+	case ER_BUG:         index = SIM_ER_BUG;         break;
+	case ER_HEAT:        index = SIM_ER_HEAT;        break;
+	case ER_USART_RX:    index = SIM_ER_USART_RX;    break;
+	case ER_FLASH_WRITE: index = SIM_ER_FLASH_WRITE; break;
+	case ER_CMDOVERFLOW: index = SIM_ER_CMDOVERFLOW; break;
+	default:             index = SIM_ER_OTHER;       break;
+	}
+	sim_errors[index]++;
+
+	if (sim_verbose || action != EA_RESUME) {
+		fprintf(stderr, "error (%s): %.*s\n",
+			sim_error_names[index], length, message);
+	}
+
+	if (action == EA_PANIC) {
+		fprintf(stderr, "Module panicked, stopping.\n");
+		exit(2);
+	} else if (action == EA_RESET) {
+		fprintf(stderr, "Module reset, stopping.\n");
+		exit(2);
+	}
+}
+
+/*
+ * An update would not return to normal operation, so it ends the
+ * simulation like a reset.
+ */
+error_t update_start(uint16_t chunks, uint32_t image_crc) {
+	if (chunks == 0 || chunks > UPDATE_MAX_CHUNKS) {
+		return E_INDEXRANGE;
+	}
+
+	fprintf(stderr, "Update of %u chunks with CRC %08x started, stopping.\n",
+		chunks, image_crc);
+	exit(2);
+}
@@ -0,0 +1,38 @@
+#ifndef SIM_STUBS_H
+#define SIM_STUBS_H
+
+#include <stdbool.h>
+
+#include "../error.h"
+
+/*
+ * The error reasons counted by the simulated error().
+ */
+typedef enum {
+	SIM_ER_NO_CONFIG,
+	SIM_ER_BUG,
+	SIM_ER_HEAT,
+	SIM_ER_USART_RX,
+	SIM_ER_FLASH_WRITE,
+	SIM_ER_CMDOVERFLOW,
+	SIM_ER_OTHER,
+	SIM_ER_COUNT
+} sim_error_t;
+
+/*
+ * Number of calls to error() so far, by reason.
+ */
+extern unsigned long sim_errors[SIM_ER_COUNT];
+
+/*
+ * Names of the error reasons for printing.
+ */
+extern const char *const sim_error_names[SIM_ER_COUNT];
+
+/*
+ * If set, the console output and the messages of all errors are
+ * printed to stderr.
+ */
+extern bool sim_verbose;
+
+#endif
@@ -1,6 +1,7 @@
 #include "config.h"
 #include "debug.h"
 #include "error.h"
+#include "event.h"
 #include "heat.h"
 #include "pwm.h"
 #include "main.h"
@@ -32,8 +33,8 @@ extern int _bss_start;
 extern int _bss_end;
 
 /*
- * The interrupt vector. This goes at the very start of Flash (starting at
- * 0x0800 0000)
+ * The interrupt vector. This goes at the start of the firmware area
+ * (starting at 0x0800 0800, after the loader), see loader.c.
  */
 void (*volatile interrupts[])() __attribute__ ((section (".isr_vector"))) = {
 	(void (*)()) &_stack_end, /* 0x0000: top of stack */
@@ -66,9 +67,9 @@ void (*volatile interrupts[])() __attribute__ ((section (".isr_vector"))) = {
 	unexpected_interrupt, /* 0x006c: DMA1 channel 1 */
 	unexpected_interrupt, /* 0x0070: DMA1 channel 2 */
 	unexpected_interrupt, /* 0x0074: DMA1 channel 3 */
-	unexpected_interrupt, /* 0x0078: DMA1 channel 4 */
+	isr_dma1_channel4, /* 0x0078: DMA1 channel 4 */
 	unexpected_interrupt, /* 0x007c: DMA1 channel 5 */
-	unexpected_interrupt, /* 0x0080: DMA1 channel 6 */
+	isr_dma1_channel6, /* 0x0080: DMA1 channel 6 */
 	unexpected_interrupt, /* 0x0084: DMA1 channel 7 */
 	ignore, /* 0x0088: ADC1 */
 	unexpected_interrupt, /* 0x008c: unused */
@@ -80,7 +81,7 @@ void (*volatile interrupts[])() __attribute__ ((section (".isr_vector"))) = {
 	unexpected_interrupt, /* 0x00a4: unused */
 	unexpected_interrupt, /* 0x00a8: unused */
 	unexpected_interrupt, /* 0x00ac: unused */
-	unexpected_interrupt, /* 0x00b0: unused */
+	isr_tim2, /* 0x00b0: TIM2 */
 	unexpected_interrupt, /* 0x00b4: unused */
 	unexpected_interrupt, /* 0x00b8: unused */
 	unexpected_interrupt, /* 0x00bc: unused */
@@ -291,12 +292,12 @@ void startup() {
  */
 void __attribute__ ((interrupt("IRQ"))) systick() {
 #ifndef OMIT_HEAT_CHECK
-	if (do_heat_check) {
+	if (event_is_pending(EVENT_HEAT)) {
 		// There has been no heat check since last time the
-		// flag was set.
+		// event was posted.
 		error(ER_BUG, STR_WITH_LEN("No heat check happened"), EA_RESUME);
 	}
-	do_heat_check = 1;
+	event_post(EVENT_HEAT);
 #endif
 }
 
@@ -0,0 +1,136 @@
+#include "stats.h"
+
+#include "config.h"
+#include "console.h"
+#include "debug.h"
+#include "term.h"
+#include "usart1.h"
+
+volatile stats_t stats;
+
+/*
+ * Starts the cycle counter. The counters start at zero.
+ *
+ * Command cycles are measured as differences of the free-running
+ * cycle counter. The COUNT_* debug options restart it, which spoils
+ * the measurement while they are enabled.
+ */
+void stats_init() {
+	cycle_start();
+}
+
+/*
+ * Records a command run by the main loop which took the given number
+ * of cycles.
+ */
+void stats_command(uint32_t cycles) {
+	stats.commands++;
+	stats.command_cycles_total += cycles;
+	if (cycles > stats.command_cycles_max) {
+		stats.command_cycles_max = cycles;
+	}
+}
+
+/*
+ * Returns the average number of cycles of the commands run by the
+ * main loop.
+ */
+uint32_t stats_average_cycles() {
+	if (stats.commands == 0) {
+		return 0;
+	}
+	return stats.command_cycles_total / stats.commands;
+}
+
+/*
+ * Prints the counters on the console as text.
+ */
+void stats_show() {
+	// The text is longer than the output buffer.
+	int blocking = usart1_set_blocking(1);
+
+	console_write("Statistics since reset:" CRLF);
+
+	console_write("Frames accepted: ");
+	console_uint_d(stats.frames_accepted);
+	console_write("  filtered: ");
+	console_uint_d(stats.frames_filtered);
+	console_write(CRLF);
+
+	console_write("Bad escapes: ");
+	console_uint_d(stats.bad_escapes);
+	console_write("  overflows: ");
+	console_uint_d(stats.overflows);
+	console_write("  USART errors: ");
+	console_uint_d(stats.usart_errors);
+	console_write(CRLF);
+
+	console_write("Strobes: ");
+	console_uint_d(stats.strobes);
+	console_write("  commands: ");
+	console_uint_d(stats.commands);
+	console_write("  cycles max: ");
+	console_uint_d(stats.command_cycles_max);
+	console_write("  avg: ");
+	console_uint_d(stats_average_cycles());
+	console_write(CRLF);
+
+	console_write("Debug output dropped: ");
+	console_uint_d(usart1_dropped());
+	console_write(CRLF);
+
+	usart1_set_blocking(blocking);
+}
+
+/*
+ * Writes the counters to USART1 in a compact binary form.
+ */
+void stats_dump() {
+	uint32_t words[] = {
+		stats.frames_accepted,
+		stats.frames_filtered,
+		stats.bad_escapes,
+		stats.overflows,
+		stats.usart_errors,
+		stats.strobes,
+		stats.commands,
+		stats.command_cycles_max,
+		stats_average_cycles(),
+		usart1_dropped()
+	};
+	const int count = sizeof(words) / sizeof(words[0]);
+
+	// The dump is useless to the host if a part of it is dropped.
+	int blocking = usart1_set_blocking(1);
+
+	console_putchar(STATS_DUMP_KEY);
+	console_putchar(config.my_address);
+	console_putchar(count);
+	for (int i = 0; i < count; i++) {
+		for (int b = 0; b < 4; b++) {
+			console_putchar((words[i] >> (8 * b)) & 0xff);
+		}
+	}
+
+	usart1_set_blocking(blocking);
+}
+
+/*
+ * Handles the input received on USART1 in normal mode. The dump key
+ * causes a dump, the show key prints the counters as text, other
+ * input is dropped.
+ */
+void stats_poll() {
+	while (usart1_has_input()) {
+		switch (usart1_getchar()) {
+		case STATS_DUMP_KEY:
+			stats_dump();
+			break;
+		case STATS_SHOW_KEY:
+			stats_show();
+			break;
+		default:
+			break;
+		}
+	}
+}
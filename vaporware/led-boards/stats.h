@@ -0,0 +1,86 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Counters of what the module has seen on the bus since the last
+ * reset. Each counter is only written either from the USART2 ISR or
+ * from the main loop, so no locking is needed. Counters wrap around.
+ */
+typedef struct {
+	// Commands addressed to this module or broadcast.
+	uint32_t frames_accepted;
+	// Commands addressed to other modules.
+	uint32_t frames_filtered;
+	// Escape marks followed by an invalid byte.
+	uint32_t bad_escapes;
+	// Commands dropped because no buffer was free.
+	uint32_t overflows;
+	// Framing, noise and overrun errors of USART2.
+	uint32_t usart_errors;
+	// Strobe commands run.
+	uint32_t strobes;
+	// Commands run by the main loop and their cycle counts.
+	uint32_t commands;
+	uint32_t command_cycles_max;
+	uint64_t command_cycles_total;
+} stats_t;
+
+extern volatile stats_t stats;
+
+/*
+ * The key which requests a binary dump of the counters on USART1 in
+ * normal mode.
+ */
+#define STATS_DUMP_KEY 'S'
+
+/*
+ * The key which requests the counters as text on USART1 in normal
+ * mode.
+ */
+#define STATS_SHOW_KEY 's'
+
+/*
+ * Starts the cycle counter used for the command cycles.
+ */
+void stats_init();
+
+/*
+ * Records a command run by the main loop which took the given number
+ * of cycles.
+ */
+void stats_command(uint32_t cycles);
+
+/*
+ * Returns the average number of cycles of the commands run by the
+ * main loop.
+ */
+uint32_t stats_average_cycles();
+
+/*
+ * Prints the counters on the console as text.
+ */
+void stats_show();
+
+/*
+ * Writes the counters to USART1 in a compact binary form:
+ *
+ *     'S' <address> <count> <count * uint32>
+ *
+ * The words are little endian and hold frames accepted, frames
+ * filtered, bad escapes, overflows, USART errors, strobes, commands,
+ * maximum and average cycles per command and characters of debug
+ * output dropped, in this order. New words are only appended at the
+ * end.
+ */
+void stats_dump();
+
+/*
+ * Handles the input received on USART1 in normal mode. The dump key
+ * causes a dump, the show key prints the counters as text, other
+ * input is dropped.
+ */
+void stats_poll();
+
+#endif
@@ -0,0 +1,48 @@
+#include "update.h"
+
+#include "stm_include/stm32/scb.h"
+
+#include "pwm.h"
+#include "sync.h"
+
+/*
+ * Replaces the firmware by an image of the given number of chunks
+ * received over the bus. image_crc is the CRC-32 of the whole image.
+ *
+ * The PWM outputs are switched off and the module resets into the
+ * loader, which erases the firmware area and receives the image (see
+ * HACKING). The loader itself is never erased, so a module that loses
+ * power during the update starts in the loader again and waits for
+ * the next update.
+ *
+ * Only returns if chunks is out of range, or if the module already
+ * runs this image, which the host sends the update command again for
+ * every pass.
+ *
+ * Returns an error/success code.
+ */
+error_t update_start(uint16_t chunks, uint32_t image_crc) {
+	if (chunks == 0 || chunks > UPDATE_MAX_CHUNKS) {
+		return E_INDEXRANGE;
+	}
+
+	if (IMAGE_INFO->chunks == chunks && IMAGE_INFO->crc == image_crc) {
+		return E_SUCCESS;
+	}
+
+	pwm_set_state(PWM_STOP);
+	interrupts_off();
+
+	UPDATE_REQUEST->crc = image_crc;
+	UPDATE_REQUEST->chunks = chunks;
+	UPDATE_REQUEST->address = config.my_address;
+	for (int g = 0; g < GROUP_COUNT; g++) {
+		UPDATE_REQUEST->groups[g] = config.groups[g];
+	}
+	UPDATE_REQUEST->magic = UPDATE_REQUEST_MAGIC;
+
+	SCB_AIRCR = SCB_AIRCR_VECTKEY | SCB_AIRCR_SYSRESETREQ;
+	while (1);
+
+	return E_SUCCESS;
+}
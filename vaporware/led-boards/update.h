@@ -0,0 +1,74 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "error.h"
+
+// Largest number of chunks a firmware image can have. The last chunk
+// of the firmware area is left for the image info.
+#define UPDATE_MAX_CHUNKS (FIRMWARE_SIZE / UPDATE_CHUNK_SIZE - 1)
+
+// Command codes of the frames that start an update and carry the
+// image.
+#define UPDATE_START 0x07
+#define UPDATE_CHUNK 0x08
+#define UPDATE_END 0x09
+
+/*
+ * Describes the image in the firmware area, so that the loader can
+ * check it at boot. It is written by the loader once an update is
+ * complete, and by flash.sh. The number of chunks is stored a second
+ * time, inverted, so that an erased or half written info is never
+ * taken for a valid one.
+ */
+typedef struct {
+	uint16_t chunks;
+	uint16_t chunks_inverted;
+	uint32_t crc;
+} image_info_t;
+
+// The image info is kept at the very end of the firmware area.
+#define IMAGE_INFO ((const image_info_t*) \
+		    (FIRMWARE_START + FIRMWARE_SIZE - sizeof(image_info_t)))
+
+/*
+ * The request to receive an update, which the firmware leaves for the
+ * loader in the first bytes of RAM before it resets. Both linker
+ * scripts keep these bytes out of the RAM they use. The address and
+ * groups are those of the module, so that the loader accepts the same
+ * frames as the firmware did.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t crc;
+	uint16_t chunks;
+	uint8_t address;
+	uint8_t groups[GROUP_COUNT];
+} update_request_t;
+
+#define UPDATE_REQUEST ((volatile update_request_t*) 0x20000000)
+#define UPDATE_REQUEST_SIZE 16
+// "VLUP", anything else in magic is no request.
+#define UPDATE_REQUEST_MAGIC 0x564c5550
+
+/*
+ * Replaces the firmware by an image of the given number of chunks
+ * received over the bus. image_crc is the CRC-32 of the whole image.
+ *
+ * The PWM outputs are switched off and the module resets into the
+ * loader, which erases the firmware area and receives the image (see
+ * HACKING). The loader itself is never erased, so a module that loses
+ * power during the update starts in the loader again and waits for
+ * the next update.
+ *
+ * Only returns if chunks is out of range, or if the module already
+ * runs this image, which the host sends the update command again for
+ * every pass.
+ *
+ * Returns an error/success code.
+ */
+error_t update_start(uint16_t chunks, uint32_t image_crc);
+
+#endif
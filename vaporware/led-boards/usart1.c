@@ -10,52 +10,146 @@
 
 #include "config.h"
 #include "error.h"
+#include "event.h"
 #include "pwm.h"
 #include "sync.h"
 #include "term.h"
 
+#include "stm_include/stm32/dma.h"
 #include "stm_include/stm32/nvic.h"
 #include "stm_include/stm32/usart.h"
 
 /***************************************
  * Output side
+ *
+ * Output is collected in a ring buffer, from which DMA1 channel 4
+ * sends one block at a time.
  */
 
 #define OUTPUT_BUFFER_LENGTH 80
+
+// Blocks are kept short so that urgent characters are not delayed
+// for long.
+#define OUTPUT_BLOCK_LENGTH 16
+
 static char output_buffer[OUTPUT_BUFFER_LENGTH];
 static int output_write_index = 0;
 static int output_read_index = 0;
 
-// The number of characters still to be sent.  Not strictly necessary,
-// but makes code easier to understand.  This must be volatile,
-// because it is accessed concurrently in usart1_putchar.
+// The number of characters in the buffer, including the block which
+// is being sent.  This must be volatile, because it is accessed
+// concurrently in usart1_putchar.
 static volatile int output_pending = 0;
 
-// Set to 1 by the ISR when the USART is done and no character is left
-// in the buffer. Then, the next character must not be enqueued but sent directly.
-static int output_idle = 0;
+// The length of the block being sent by the DMA, 0 if it is idle.
+static int output_block = 0;
+
+// If this is 0, characters are dropped instead of waiting for space
+// in the buffer.
+static int output_blocking = 1;
+
+// The number of characters dropped.
+static volatile uint32_t output_dropped = 0;
 
 // When this is not '\0', it holds a character that must urgently be
 // sent via the USART (this is used for flow control).
 static char urgent_send = '\0';
 
 /*
- * Sends a character via USART1.
+ * Starts sending the next block, if the DMA is idle. An urgent
+ * character is sent before it. Must be called from an ISR or with
+ * interrupts off.
  */
-void usart1_putchar(const char message) {
-	// Before going atomic, make sure there is space in the
-	// output buffer.  Since the ISR only decreases
-	// output_pending, no double checked locking is necessary.
-	while (output_pending >= OUTPUT_BUFFER_LENGTH) {
-		if (!(USART1_CR1 & USART_CR1_TXEIE)) {
-			error(ER_BUG,
-			      STR_WITH_LEN("TXEIE lost"),
-			      EA_PANIC);
+static void start_output() {
+	if (output_block > 0) {
+		return;
+	}
+
+	if (urgent_send != '\0') {
+		if (!(USART1_SR & USART_SR_TXE)) {
+			// Come back when the data register is free.
+			USART1_CR1 |= USART_CR1_TXEIE;
+			return;
 		}
+		USART1_DR = urgent_send;
+		urgent_send = '\0';
+	}
+	USART1_CR1 &= ~USART_CR1_TXEIE;
+
+	if (output_pending == 0) {
+		return;
+	}
+
+	if (output_write_index > output_read_index) {
+		output_block = output_write_index - output_read_index;
+	} else {
+		output_block = OUTPUT_BUFFER_LENGTH - output_read_index;
+	}
+	if (output_block > OUTPUT_BLOCK_LENGTH) {
+		output_block = OUTPUT_BLOCK_LENGTH;
+	}
+
+	DMA1_CMAR4 = (uint32_t) &output_buffer[output_read_index];
+	DMA1_CNDTR4 = output_block;
+	DMA1_CCR4 = (DMA_CCR4_PL_LOW << DMA_CCR4_PL_LSB) |    // Low priority
+		(DMA_CCR4_MSIZE_8BIT << DMA_CCR4_MSIZE_LSB) | // 8 bit memory size
+		(DMA_CCR4_PSIZE_8BIT << DMA_CCR4_PSIZE_LSB) | // 8 bit peripheral size
+		DMA_CCR4_MINC |                               // Memory auto-increment
+		DMA_CCR4_DIR |                                // Memory to peripheral
+		DMA_CCR4_TEIE |                               // Transfer error interrupt
+		DMA_CCR4_TCIE |                               // Transfer complete interrupt
+		DMA_CCR4_EN;                                  // enable
+}
+
+/*
+ * Removes the block the DMA has sent from the buffer. Must be called
+ * from an ISR or with interrupts off.
+ */
+static void finish_output() {
+	DMA1_IFCR = DMA_IFCR_CGIF4;
+	DMA1_CCR4 = 0;
+
+	output_read_index += output_block;
+	if (output_read_index == OUTPUT_BUFFER_LENGTH) {
+		output_read_index = 0;
 	}
 
+	output_pending -= output_block;
+	output_block = 0;
+}
+
+/*
+ * Sends a character via USART1.
+ */
+void usart1_putchar(const char message) {
 	interrupts_off();
 
+	if (output_pending >= OUTPUT_BUFFER_LENGTH) {
+		if (!output_blocking) {
+			output_dropped++;
+			interrupts_on();
+			return;
+		}
+
+		// Wait for the current block to be sent. This does
+		// not rely on the interrupts, so that errors can
+		// still be reported from an ISR.
+		while (output_pending >= OUTPUT_BUFFER_LENGTH) {
+			if (output_block == 0) {
+				start_output();
+			} else if (DMA1_ISR & DMA_ISR_TCIF4) {
+				finish_output();
+			}
+#ifdef USART1_CHECKS
+			else if (!(DMA1_CCR4 & DMA_CCR4_EN)) {
+				error(ER_BUG,
+				      STR_WITH_LEN("USART1 DMA lost"),
+				      EA_PANIC);
+			}
+#endif
+		}
+	}
+
 	output_buffer[output_write_index++] = message;
 	if (output_write_index == OUTPUT_BUFFER_LENGTH) {
 		output_write_index = 0;
@@ -63,49 +157,39 @@ void usart1_putchar(const char message) {
 
 	output_pending++;
 
-	if (output_idle) {
-		output_idle = 0;
-		USART1_CR1 |= USART_CR1_TXEIE;
-	}
+	start_output();
 
 	interrupts_on();
-
 }
 
-static void isr_ready_to_send() {
-	if (urgent_send != '\0') {
-		USART1_DR = urgent_send;
-		urgent_send = '\0';
-
-	} else if (output_pending > 0) {
-		USART1_DR = output_buffer[output_read_index++];
-		if (output_read_index == OUTPUT_BUFFER_LENGTH) {
-			output_read_index = 0;
-		}
-
-		output_pending--;
-
-	} else /* output_pending == 0 */ {
-		// Switch off TXE interrupt to avoid infinite
-		// interrupt loop.
-		USART1_CR1 &= ~(USART_CR1_TXEIE);
+/*
+ * Sets whether usart1_putchar waits for space in the output buffer
+ * or drops the character.
+ *
+ * Returns the previous setting.
+ */
+int usart1_set_blocking(int blocking) {
+	int previous = output_blocking;
+	output_blocking = blocking;
+	return previous;
+}
 
-		output_idle = 1;
-	}
+/*
+ * Returns the number of characters dropped because the output buffer
+ * was full.
+ */
+uint32_t usart1_dropped() {
+	return output_dropped;
 }
 
 /*
- * If the USART is idle, sends the given message. Otherwise, sets
- * urgent_send to the message. The previous content of urgent_send
- * will be overwritten if it has not yet been sent.
+ * Sends the given message before all other output. The previous
+ * content of urgent_send will be overwritten if it has not yet been
+ * sent. Must be called from an ISR or with interrupts off.
  */
 static void usart1_urgent_send(char message) {
 	urgent_send = message;
-
-	if (output_idle) {
-		output_idle = 0;
-		USART1_CR1 |= USART_CR1_TXEIE;
-	}
+	start_output();
 }
 
 /***************************************
@@ -139,6 +223,7 @@ static void isr_read_input(char input) {
 	}
 
 	input_pending++;
+	event_post(EVENT_CONSOLE);
 
 	if (input_pending > XOFF_TRESHOLD) {
 		// This repeatedly sends XOFF when more data is
@@ -195,10 +280,15 @@ int usart1_has_input() {
 void usart1_init() {
 	USART1_BRR = CONSOLE_BAUD_VALUE;
 
+	// Output is sent by DMA1 channel 4, see start_output.
+	DMA1_CPAR4 = (uint32_t) &USART1_DR;
+	USART1_CR3 = USART_CR3_DMAT;
+
 	USART1_CR1 = USART_CR1_UE |
-		USART_CR1_TE | USART_CR1_TXEIE |
+		USART_CR1_TE |
 		USART_CR1_RE | USART_CR1_RXNEIE;
 
+	NVIC_ISER(0) |= (1 << NVIC_DMA1_CHANNEL4_IRQ);
 	NVIC_ISER(1) |= (1 << (NVIC_USART1_IRQ - 32));
 }
 
@@ -211,10 +301,32 @@ void __attribute__ ((interrupt("IRQ"))) isr_usart1() {
 
 	unsigned short dr = USART1_DR; // This read resets the error flags.
 
-	if (sr & USART_SR_TXE) {
-		isr_ready_to_send();
+	if ((sr & USART_SR_TXE) && (USART1_CR1 & USART_CR1_TXEIE)) {
+		// An urgent character is waiting.
+		start_output();
 	}
 	if (sr & USART_SR_RXNE) {
 		isr_read_input((char)dr);
 	}
 }
+
+/*
+ * ISR for DMA1 channel 4 (USART1 TX).
+ *
+ * Called when a block has been sent.
+ */
+void __attribute__ ((interrupt("IRQ"))) isr_dma1_channel4() {
+	if (DMA1_ISR & DMA_ISR_TEIF4) {
+		error(ER_BUG, STR_WITH_LEN("DMA transfer error on USART1"), EA_PANIC);
+	}
+
+	// usart1_putchar may have finished the block and started the
+	// next one while interrupts were off, leaving this interrupt
+	// pending for a block that is still being sent.
+	if (!(DMA1_ISR & DMA_ISR_TCIF4)) {
+		return;
+	}
+
+	finish_output();
+	start_output();
+}
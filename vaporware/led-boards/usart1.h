@@ -1,6 +1,8 @@
 #ifndef USART1_H
 #define USART1_H
 
+#include <stdint.h>
+
 /*
  * Initializes the debug and configuration USART. This must be called
  * before any other function in this module (which includes the debug
@@ -13,6 +15,21 @@ void usart1_init();
  */
 void usart1_putchar(const char message);
 
+/*
+ * Sets whether usart1_putchar waits for space in the output buffer
+ * (the default) or drops the character. Dropping keeps trace output
+ * from stalling the main loop.
+ *
+ * Returns the previous setting.
+ */
+int usart1_set_blocking(int blocking);
+
+/*
+ * Returns the number of characters dropped because the output buffer
+ * was full.
+ */
+uint32_t usart1_dropped();
+
 /*
  * Returns the next character received via the debug USART.
  * This function blocks until a character is available.
@@ -32,4 +49,9 @@ int usart1_has_input();
  */
 void isr_usart1();
 
+/*
+ * ISR for DMA1 channel 4 (USART1 TX).
+ */
+void isr_dma1_channel4();
+
 #endif
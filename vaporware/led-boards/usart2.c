@@ -3,13 +3,16 @@
 #include "command.h"
 #include "config.h"
 #include "error.h"
+#include "event.h"
 #include "fail.h"
+#include "stats.h"
 #include "sync.h"
 
 #if defined COUNT_USART_ISR || defined TRACE_USART
 	#include "debug.h"
 #endif
 
+#include "stm_include/stm32/dma.h"
 #include "stm_include/stm32/nvic.h"
 #include "stm_include/stm32/usart.h"
 
@@ -38,19 +41,47 @@ static usart_address_filter_t address_filter;
  */
 static usart_length_check_t length_check;
 
+/*
+ * The currently set merge check function for USART commands.
+ */
+static usart_merge_check_t merge_check;
+
+/*
+ * Marks a queue entry without a buffer. Such an entry stands for a
+ * command consisting only of the command code.
+ */
+#define NO_BUFFER 0xff
+
+/*
+ * An entry of the command queue.
+ */
+typedef struct {
+	// The buffer holding the command, or NO_BUFFER.
+	uint8_t buffer;
+	// The command code, for commands without a buffer.
+	uint8_t code;
+} queue_entry_t;
+
 /*
  * Shared between ISR and usart_next_command.
  * Remember to synchronize!
  *
- * commands_pending is incremented by the ISR when a command has been fully
- * received and stored. If usart_next_command finds commands_pending to be
- * greater than 0, a command is available at *read_buffer. After processing
- * this command, usart_next_command advances read_buffer by one buffer and
- * decrements commands_pending. If commands_pending equals USART_BUFFER_COUNT,
- * the ISR may not store another command (the command will be dropped), because
- * all buffers already contain a command to be read by usart_next_command.
+ * The ISR appends each fully received command to queue, and
+ * usart_next_command takes them from the front. The ISR receives into
+ * a buffer that is neither queued nor being read. Before a command is
+ * appended, the ISR removes the queued commands it makes obsolete (see
+ * usart2_set_merge_check). If no buffer is free, the ISR also removes
+ * the oldest command that a later one makes obsolete. Only if this is
+ * not possible either, the new command must be dropped.
+ *
+ * Commands consisting only of the command code (i.e. strobes) are
+ * kept in the queue itself and do not need a buffer.
  */
-static volatile int commands_pending = 0;
+static queue_entry_t queue[USART_QUEUE_LEN];
+static volatile int queue_length = 0;
+
+// Bit i is set if isr_buffers[i] is queued, being read or being written.
+static volatile uint32_t buffers_used = 0;
 
 /*
  * Also shared between ISR and usart_next_command.
@@ -61,13 +92,16 @@ static volatile int commands_pending = 0;
  */
 static volatile int command_overflow = 0;
 
-// A ring buffer for concurrent read and write.
+// The command buffers.
 static unsigned char isr_buffers[USART_BUFFER_COUNT][CMD_BUFFER_LEN];
 
-// The buffer currently read from.
-static int read_buffer = 0;
+// The buffer currently read from, or NO_BUFFER.
+static uint8_t read_buffer = NO_BUFFER;
 
-// 1, if the "outside" is currently reading from read_buffer.
+// The command currently read from, if it has no buffer.
+static unsigned char read_code[1];
+
+// 1, if the "outside" is currently reading a command.
 static int is_reading = 0;
 
 /*
@@ -77,28 +111,64 @@ static int is_reading = 0;
 static isr_state_t isr_state = IDLE;
 // 1, if the last character was ESCAPE_MARK
 static int isr_escape = 0;
-// The buffer currently used for writing.
-static int isr_write_buffer = 0;
+// The buffer currently used for writing, or NO_BUFFER if none is free.
+static uint8_t isr_write_buffer = NO_BUFFER;
 // Index into the writing buffer, points to first free space.
 static int isr_write_idx = 0;
 // Total number of bytes remaining until the next length check.
 static int isr_bytes_remaining = 0;
+// Number of bytes to drop before storing the next byte.
+static int isr_skip = 0;
 // USART failure counter.
 static fail_t isr_usart_fails;
 
+/*
+ * The circular buffer DMA1 channel 6 writes the received bytes to.
+ */
+static volatile uint8_t dma_buffer[USART_DMA_BUFFER_LEN];
+// Index of the next byte in dma_buffer that has not been processed yet.
+static int dma_read_idx = 0;
+
+/*
+ * This is implemented with the other ISR helper functions below.
+ */
+static void isr_allocate_buffer();
+
 /*
  * Initializes the RS485 bus USART. This must be called before any other
  * function accessing the USART.
  */
 void usart2_init() {
 	fail_init(&isr_usart_fails, USART_FAIL_TRESHOLD);
+	isr_allocate_buffer();
 
 	USART2_BRR = USART_BAUD_VALUE;
 
+	// Received bytes are written to dma_buffer by DMA1 channel 6.
+	// They are processed on the half transfer and transfer
+	// complete interrupts and when the bus becomes idle (i.e. after
+	// each burst of frames), so there is no interrupt per byte.
+	DMA1_CPAR6 = (uint32_t) &USART2_DR;
+	DMA1_CMAR6 = (uint32_t) &dma_buffer;
+	DMA1_CNDTR6 = USART_DMA_BUFFER_LEN;
+	DMA1_CCR6 = (DMA_CCR6_PL_VERY_HIGH << DMA_CCR6_PL_LSB) | // Very high priority
+		(DMA_CCR6_MSIZE_8BIT << DMA_CCR6_MSIZE_LSB) |    // 8 bit memory size
+		(DMA_CCR6_PSIZE_8BIT << DMA_CCR6_PSIZE_LSB) |    // 8 bit peripheral size
+		DMA_CCR6_MINC |                                  // Memory auto-increment
+		DMA_CCR6_CIRC |                                  // Circular mode
+		DMA_CCR6_TEIE |                                  // Transfer error interrupt
+		DMA_CCR6_HTIE |                                  // Half transfer interrupt
+		DMA_CCR6_TCIE |                                  // Transfer complete interrupt
+		DMA_CCR6_EN;                                     // enable
+
+	USART2_CR3 = USART_CR3_DMAR | // Receive by DMA
+		USART_CR3_EIE;        // Interrupt on framing error, noise and overrun
+
 	USART2_CR1 = USART_CR1_UE |
-		USART_CR1_RXNEIE |
+		USART_CR1_IDLEIE |
 		USART_CR1_RE;
 
+	NVIC_ISER(0) |= (1 << NVIC_DMA1_CHANNEL6_IRQ);
 	NVIC_ISER(1) |= (1 << (NVIC_USART2_IRQ - 32));
 }
 
@@ -111,13 +181,9 @@ unsigned char *usart2_next_command() {
 	// 1. Free the last command if it was being read from.
 	if (is_reading) {
 		interrupts_off();
-		if (read_buffer == USART_BUFFER_COUNT - 1) {
-			read_buffer = 0;
-		} else {
-			read_buffer++;
+		if (read_buffer != NO_BUFFER) {
+			buffers_used &= ~(1 << read_buffer);
 		}
-		atomic_decrement(&commands_pending);
-
 		is_reading = 0;
 		interrupts_on();
 	}
@@ -129,15 +195,34 @@ unsigned char *usart2_next_command() {
 	}
 
 	// 3. Check if there is a new command.
-	// Note that this section need not be atomic, because even if
-	// an interrupt occurs here, it can only append to the
-	// command buffer and never overwrite an existing command.
-	if (commands_pending > 0) {
+	unsigned char *command = (unsigned char*) 0;
+
+	interrupts_off();
+	if (queue_length > 0) {
+		read_buffer = queue[0].buffer;
+		if (read_buffer == NO_BUFFER) {
+			read_code[0] = queue[0].code;
+			command = read_code;
+		} else {
+			command = isr_buffers[read_buffer];
+		}
+
+		queue_length--;
+		for (int i = 0; i < queue_length; i++) {
+			queue[i] = queue[i + 1];
+		}
 		is_reading = 1;
-		return &(isr_buffers[read_buffer][0]);
-	} else {
-		return (unsigned char*) 0;
 	}
+	interrupts_on();
+
+	return command;
+}
+
+/*
+ * Returns true if no command is waiting or being read.
+ */
+bool usart2_is_idle() {
+	return queue_length == 0 && !is_reading;
 }
 
 /*
@@ -156,10 +241,141 @@ void usart2_set_length_check(usart_length_check_t check) {
 	length_check = check;
 }
 
+/*
+ * Sets a merge check function for USART reception.
+ */
+void usart2_set_merge_check(usart_merge_check_t check) {
+	merge_check = check;
+}
+
 /*
  * Functions for the ISR (and the ISR itself).
  */
 
+/*
+ * Returns the command of a queue entry.
+ */
+static uint8_t *isr_entry_command(queue_entry_t *entry) {
+	if (entry->buffer == NO_BUFFER) {
+		return &entry->code;
+	} else {
+		return isr_buffers[entry->buffer];
+	}
+}
+
+/*
+ * Removes the queue entry with the given index and frees its buffer.
+ */
+static void isr_remove_entry(int index) {
+	if (queue[index].buffer != NO_BUFFER) {
+		buffers_used &= ~(1 << queue[index].buffer);
+	}
+
+	queue_length--;
+	for (int i = index; i < queue_length; i++) {
+		queue[i] = queue[i + 1];
+	}
+}
+
+/*
+ * Removes the queued commands that the given command makes obsolete,
+ * up to the last barrier.
+ */
+static void isr_merge(uint8_t *command) {
+	for (int i = queue_length - 1; i >= 0; i--) {
+		usart_merge_t merge = merge_check(command, isr_entry_command(&queue[i]));
+
+		if (merge == USART_BARRIER) {
+			break;
+		} else if (merge == USART_REPLACE) {
+			isr_remove_entry(i);
+		}
+	}
+}
+
+/*
+ * Makes room in the queue by removing the oldest command that a later
+ * command makes obsolete, regardless of barriers. Two equal commands
+ * without a buffer in a row are merged, too.
+ *
+ * Returns 1 if a command has been removed, 0 otherwise.
+ */
+static int isr_make_room() {
+	for (int i = 0; i < queue_length - 1; i++) {
+		uint8_t *older = isr_entry_command(&queue[i]);
+
+		if (queue[i].buffer == NO_BUFFER &&
+		    queue[i + 1].buffer == NO_BUFFER &&
+		    queue[i].code == queue[i + 1].code) {
+			isr_remove_entry(i);
+			return 1;
+		}
+
+		for (int j = i + 1; j < queue_length; j++) {
+			uint8_t *newer = isr_entry_command(&queue[j]);
+
+			if (merge_check(newer, older) == USART_REPLACE) {
+				isr_remove_entry(i);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sets isr_write_buffer to a free buffer, making room if necessary.
+ * If no buffer can be freed, it is set to NO_BUFFER.
+ */
+static void isr_allocate_buffer() {
+	do {
+		for (int i = 0; i < USART_BUFFER_COUNT; i++) {
+			if (!(buffers_used & (1 << i))) {
+				buffers_used |= 1 << i;
+				isr_write_buffer = i;
+				return;
+			}
+		}
+	} while (isr_make_room());
+
+	isr_write_buffer = NO_BUFFER;
+}
+
+/*
+ * Appends the command in isr_write_buffer with the given length to
+ * the queue and posts EVENT_COMMAND.
+ *
+ * Returns 1 on success, 0 if the command had to be dropped.
+ */
+static int isr_enqueue(int length) {
+	uint8_t *command = isr_buffers[isr_write_buffer];
+
+	isr_merge(command);
+
+	if (queue_length == USART_QUEUE_LEN && !isr_make_room()) {
+		return 0;
+	}
+
+	if (length == 1) {
+		// Keep the write buffer for the next command.
+		queue[queue_length].buffer = NO_BUFFER;
+		queue[queue_length].code = command[0];
+		queue_length++;
+	} else {
+		queue[queue_length].buffer = isr_write_buffer;
+		queue_length++;
+
+		// The next buffer is only allocated once another
+		// command for this module starts, so that no queued
+		// command is dropped for one that may never come.
+		isr_write_buffer = NO_BUFFER;
+	}
+
+	event_post(EVENT_COMMAND);
+	return 1;
+}
+
 /*
  * Handles an error on the USART by discarding the unfinished command and
  * recording the failure.
@@ -196,6 +412,7 @@ static void isr_read_command(unsigned char in_byte) {
 			break;
 		default:
 			// Bad escape sequence
+			stats.bad_escapes++;
 			isr_read_error();
 			return;
 			break;
@@ -227,41 +444,59 @@ static void isr_read_command(unsigned char in_byte) {
 		// This byte (the one after start) is the destination address.
 		// Check if we are listening to it.
 		if (address_filter(in_byte)) {
+			stats.frames_accepted++;
+
 			// Check for space in the command buffers.
-			if (commands_pending >= USART_BUFFER_COUNT) {
+			if (isr_write_buffer == NO_BUFFER) {
+				isr_allocate_buffer();
+			}
+			if (isr_write_buffer == NO_BUFFER) {
 				// There are no free command buffers,
 				// this command must be dropped.
 				atomic_set(&command_overflow);
+				stats.overflows++;
 				isr_state = IDLE;
 				return;
 			}
 
 			isr_write_idx = 0;
 			isr_bytes_remaining = 1;
+			isr_skip = 0;
 
 			isr_state = READING;
 
 		} else {
+			stats.frames_filtered++;
 			isr_state = IDLE;
 		}
 		break;
 
 	case READING:
+		// Drop the parts of the command the length check is not
+		// interested in.
+		if (isr_skip > 0) {
+			isr_skip--;
+			break;
+		}
+
 		// Store the next byte.
 		isr_buffers[isr_write_buffer][isr_write_idx++] = in_byte & 0xff;
 		isr_bytes_remaining--;
 
 		if (isr_bytes_remaining <= 0) {
-			isr_bytes_remaining = length_check(isr_buffers[isr_write_buffer], isr_write_idx);
+			isr_bytes_remaining = length_check(isr_buffers[isr_write_buffer],
+							   isr_write_idx, &isr_skip);
+
+			if (isr_bytes_remaining == USART_DISCARD) {
+				isr_state = IDLE;
+				break;
+			}
 		}
 
 		if (isr_bytes_remaining <= 0) {
-			atomic_increment(&commands_pending);
-			// Allocate a new buffer.
-			if (isr_write_buffer == USART_BUFFER_COUNT - 1) {
-				isr_write_buffer = 0;
-			} else {
-				isr_write_buffer++;
+			if (!isr_enqueue(isr_write_idx)) {
+				atomic_set(&command_overflow);
+				stats.overflows++;
 			}
 			isr_state = IDLE;
 		}
@@ -275,12 +510,15 @@ static void isr_read_command(unsigned char in_byte) {
 }
 
 /*
- * Dispatches a USART interrupt. Arguments should be the status and
- * data register of the USART which caused the interrupt.
+ * Dispatches a single received byte. Arguments should be the status
+ * and data register of the USART as they would be read in a receive
+ * interrupt. This is not used by the DMA reception, but allows feeding
+ * bytes to the receiver one at a time.
  */
 void isr_dispatch(unsigned short sr, unsigned short dr) {
 	// First, check for errors.
 	if (sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE | USART_SR_PE)) {
+		stats.usart_errors++;
 		isr_read_error();
 	} else if (sr & USART_SR_RXNE) {
 		fail_event(&isr_usart_fails, 0);
@@ -290,8 +528,43 @@ void isr_dispatch(unsigned short sr, unsigned short dr) {
 	}
 }
 
+/*
+ * Runs all bytes the DMA has written to dma_buffer since the last
+ * call through the command state machine.
+ *
+ * Returns the number of bytes processed.
+ */
+static int isr_drain_dma() {
+	// CNDTR counts down and is reloaded when the DMA wraps around.
+	int write_idx = USART_DMA_BUFFER_LEN - DMA1_CNDTR6;
+	if (write_idx >= USART_DMA_BUFFER_LEN) {
+		write_idx = 0;
+	}
+
+	int count = 0;
+	while (dma_read_idx != write_idx) {
+		isr_read_command(dma_buffer[dma_read_idx]);
+		count++;
+
+		if (dma_read_idx == USART_DMA_BUFFER_LEN - 1) {
+			dma_read_idx = 0;
+		} else {
+			dma_read_idx++;
+		}
+	}
+
+	if (count > 0) {
+		fail_event(&isr_usart_fails, 0);
+	}
+
+	return count;
+}
+
 /*
  * ISR for USART2.
+ *
+ * In DMA mode, this is only called when the bus becomes idle or a
+ * reception error occurs.
  */
 void __attribute__ ((interrupt("IRQ"))) isr_usart2() {
 #ifdef COUNT_USART_ISR
@@ -299,14 +572,55 @@ void __attribute__ ((interrupt("IRQ"))) isr_usart2() {
 #endif
 
 	unsigned short sr = USART2_SR;
-	unsigned short dr = USART2_DR;
 
-	isr_dispatch(sr, dr);
+	// Process everything received up to now first, so that the
+	// error (if any) aborts the right command.
+	int bytes = isr_drain_dma();
+
+	if (sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE | USART_SR_IDLE)) {
+		// Reading DR after SR clears the flags.
+		(void) USART2_DR;
+	}
+	if (sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE)) {
+		stats.usart_errors++;
+		isr_read_error();
+	}
 
 #ifdef COUNT_USART_ISR
 	int cycles = cycle_get();
 	debug_string("UC2");
 	debug_write((char*) &cycles, 4);
+	debug_write((char*) &bytes, 4);
+#else
+	(void) bytes;
+#endif
+}
+
+/*
+ * ISR for DMA1 channel 6 (USART2 RX).
+ *
+ * Called when the receive buffer is half or completely full.
+ */
+void __attribute__ ((interrupt("IRQ"))) isr_dma1_channel6() {
+#ifdef COUNT_USART_ISR
+	cycle_start();
 #endif
 
+	uint32_t status = DMA1_ISR;
+	DMA1_IFCR = DMA_IFCR_CGIF6;
+
+	if (status & DMA_ISR_TEIF6) {
+		error(ER_USART_RX, STR_WITH_LEN("DMA transfer error on USART2"), EA_PANIC);
+	}
+
+	int bytes = isr_drain_dma();
+
+#ifdef COUNT_USART_ISR
+	int cycles = cycle_get();
+	debug_string("UD2");
+	debug_write((char*) &cycles, 4);
+	debug_write((char*) &bytes, 4);
+#else
+	(void) bytes;
+#endif
 }
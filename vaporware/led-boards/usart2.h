@@ -20,7 +20,32 @@ typedef bool ((*usart_address_filter_t)(uint8_t));
 /*
  * The type of function that can be passed to usart2_set_length_check.
  */
-typedef int ((*usart_length_check_t)(uint8_t*, int));
+typedef int ((*usart_length_check_t)(uint8_t*, int, int*));
+
+/*
+ * Return value of a length check function which aborts the reception
+ * of the current command. The command is not passed on.
+ */
+#define USART_DISCARD (-0x7fff)
+
+/*
+ * Results of a merge check function, see usart2_set_merge_check.
+ *     USART_KEEP:     The older command is still needed.
+ *     USART_REPLACE:  The newer command makes the older one obsolete.
+ *     USART_BARRIER:  The older command must not be reordered with
+ *                     the newer one, and neither with anything before.
+ */
+typedef enum {
+	USART_KEEP,
+	USART_REPLACE,
+	USART_BARRIER
+} usart_merge_t;
+
+/*
+ * The type of function that can be passed to usart2_set_merge_check.
+ * It is passed the newer and the older command.
+ */
+typedef usart_merge_t ((*usart_merge_check_t)(uint8_t*, uint8_t*));
 
 /*
  * Initializes the RS485 bus USART. This must be called before any other
@@ -35,6 +60,14 @@ void usart2_init();
  */
 unsigned char *usart2_next_command();
 
+/*
+ * Returns true if no command is waiting in the queue or being read
+ * by the main loop. A command that is finished while the receiver is
+ * idle is the next one to take effect, so the length check may run
+ * it right away.
+ */
+bool usart2_is_idle();
+
 /*
  * Sets a command filter function for USART reception.
  * The filter gets passed a USART command and must return a nonzero value
@@ -53,15 +86,49 @@ void usart2_set_address_filter(usart_address_filter_t filter);
  * which need to be received to make a complete command. It will be
  * called again after this number of bytes has been received.
  *
+ * The length check function may also set *skip to a number of bytes
+ * that are dropped before the next bytes are stored. This allows a
+ * module to keep only its own part of a command addressed to several
+ * modules. Bytes after the end of a command are ignored. If the
+ * command is of no interest after all, USART_DISCARD is returned.
+ * USART_DISCARD is also returned by a length check which has decoded
+ * the command itself while it was being received.
+ *
  * Since timing is critical in the ISR, the length check function
  * should parse the command as little as possible, and only ascertain
  * its required length.
  */
 void usart2_set_length_check(usart_length_check_t length_check);
 
+/*
+ * Sets a merge check function for USART reception.
+ *
+ * When a command has been received, the merge check function is
+ * called with it and each command still waiting to be read, from the
+ * newest to the oldest. Each waiting command for which it returns
+ * USART_REPLACE is dropped. USART_BARRIER stops the search.
+ *
+ * When all buffers are in use, the oldest waiting command which any
+ * later waiting command replaces is dropped, regardless of barriers.
+ * Only if there is none, new commands are dropped.
+ */
+void usart2_set_merge_check(usart_merge_check_t merge_check);
+
+/*
+ * Dispatches a single received byte. Arguments should be the status
+ * and data register of the USART as they would be read in a receive
+ * interrupt.
+ */
+void isr_dispatch(unsigned short sr, unsigned short dr);
+
 /*
  * ISR for USART2.
  */
 void isr_usart2();
 
+/*
+ * ISR for DMA1 channel 6 (USART2 RX).
+ */
+void isr_dma1_channel6();
+
 #endif